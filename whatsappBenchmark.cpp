@@ -0,0 +1,342 @@
+//
+// Microbenchmarks of the server kernels: command parsing, WHO, CREATE_GROUP validation, EXIT
+// cleanup, group fan-out, frame compression and frame writing. The server runs without
+// sockets and writes its replies to /dev/null, while frames are written to a socketpair that
+// a thread drains. Run "make benchmark", or the binary itself:
+//   whatsappBenchmark --benchmark_out=results.json --benchmark_out_format=json
+// The results are printed to stderr and written as JSON, the server output goes to /dev/null.
+//
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include "whatsappServer.h"
+
+#define VALIDATION_CLIENTS 100000 //clients connected while member lists are validated
+
+static int nullSocket()
+{
+    static int nullFD = open("/dev/null", O_WRONLY);
+    return nullFD;
+}
+
+static std::string clientName(long index)
+{
+    return "user" + std::to_string(index);
+}
+
+/**
+ * Registers the clients user0 to user<count - 1>.
+ */
+static void registerClients(whatsappServer &server, long count)
+{
+    for (long i = 0; i < count; i++)
+    {
+        server.handleFrame(nullSocket(), "", clientName(i));
+    }
+    server.publishPresence(); //drops the joins gathered, nobody subscribed
+}
+
+/**
+ * Sends "<command> <group_name> <names>" in as many frames as the names need.
+ */
+static void sendGroupCommand(whatsappServer &server, const std::string &sender,
+                             const std::string &command, const std::string &groupName,
+                             const std::vector<std::string> &names)
+{
+    std::string commandStart = command + " " + groupName + " ";
+    std::string frame = commandStart;
+    for (const std::string &name : names)
+    {
+        if (frame.size() > commandStart.size() && frame.size() + name.size() + 1 >= WA_MAX_INPUT)
+        {
+            frame.pop_back();
+            server.handleFrame(nullSocket(), sender, frame);
+            frame = commandStart;
+        }
+        frame.append(name).append(",");
+    }
+    frame.pop_back();
+    server.handleFrame(nullSocket(), sender, frame);
+}
+
+/**
+ * Creates a group of user0 to user<size - 1>, created by user0.
+ */
+static void createGroup(whatsappServer &server, const std::string &groupName, long size)
+{
+    std::vector<std::string> members;
+    for (long i = 2; i < size; i++)
+    {
+        members.push_back(clientName(i));
+    }
+    server.handleFrame(nullSocket(), clientName(0), "create_group " + groupName + " " + clientName(1));
+    if (!members.empty())
+    {
+        sendGroupCommand(server, clientName(0), ADD_TO_GROUP_COMMAND, groupName, members);
+    }
+}
+
+static void BM_ParseCommand(benchmark::State &state)
+{
+    std::string memberList = clientName(1);
+    for (int i = 2; i < 20; i++)
+    {
+        memberList.append(",").append(clientName(i));
+    }
+    const std::vector<std::string> commands = {"send user1 hello there, how are you?",
+                                               "create_group team " + memberList,
+                                               "add_to_group team user3,user4",
+                                               "who user 1", "exit"};
+    command_type commandT;
+    std::string name;
+    std::string message;
+    std::string prefix;
+    std::string cursor;
+    std::vector<std::string> clients;
+    bool isAdd;
+    bool isValid;
+    for (auto _ : state)
+    {
+        //In the order handleClientCommand tries the parsers
+        for (const std::string &command : commands)
+        {
+            if (parse_who(command, prefix, cursor, isValid))
+            {
+                benchmark::DoNotOptimize(isValid);
+            }
+            else if (parse_group_update(command, isAdd, name, clients))
+            {
+                benchmark::DoNotOptimize(clients.data());
+            }
+            else
+            {
+                parse_command(command, commandT, name, message, clients);
+                benchmark::DoNotOptimize(commandT);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<long>(commands.size()));
+}
+BENCHMARK(BM_ParseCommand);
+
+static void BM_WhoSerialization(benchmark::State &state)
+{
+    whatsappServer server;
+    registerClients(server, state.range(0));
+    for (auto _ : state)
+    {
+        server.writeConnectedClients(nullSocket(), "", "");
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WhoSerialization)->RangeMultiplier(10)->Range(10, 100000);
+
+static void BM_AllConnected(benchmark::State &state)
+{
+    whatsappServer server;
+    registerClients(server, VALIDATION_CLIENTS);
+    std::vector<std::string> names;
+    std::mt19937 random(1);
+    std::uniform_int_distribution<long> client(0, VALIDATION_CLIENTS - 1);
+    for (long i = 0; i < state.range(0); i++)
+    {
+        names.push_back(clientName(client(random)));
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(server.allConnected(names));
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<long>(names.size()));
+}
+BENCHMARK(BM_AllConnected)->RangeMultiplier(16)->Range(16, 65536);
+
+static void BM_CreateGroup(benchmark::State &state)
+{
+    whatsappServer server;
+    registerClients(server, VALIDATION_CLIENTS);
+    //As many members as one frame holds, picked across the clients and given out of order
+    std::string frame = "create_group team " + clientName(0);
+    std::vector<std::string> members;
+    for (long i = VALIDATION_CLIENTS - 1;
+         i > 0 && frame.size() + clientName(i).size() + 1 < WA_MAX_INPUT; i -= 997)
+    {
+        frame.append(",").append(clientName(i));
+        members.push_back(clientName(i));
+    }
+    for (auto _ : state)
+    {
+        server.handleFrame(nullSocket(), clientName(0), frame);
+        //Deletes the group again by emptying it, its creator last
+        state.PauseTiming();
+        sendGroupCommand(server, clientName(0), REMOVE_FROM_GROUP_COMMAND, "team", members);
+        sendGroupCommand(server, clientName(0), REMOVE_FROM_GROUP_COMMAND, "team", {clientName(0)});
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<long>(members.size() + 1));
+}
+BENCHMARK(BM_CreateGroup);
+
+static void BM_ExitCleanup(benchmark::State &state)
+{
+    whatsappServer server;
+    registerClients(server, state.range(0));
+    for (int group = 0; group < WA_MAX_GROUP; group++)
+    {
+        createGroup(server, "group" + std::to_string(group), state.range(0));
+    }
+    for (auto _ : state)
+    {
+        server.handleFrame(nullSocket(), clientName(1), "exit");
+        state.PauseTiming();
+        server.handleFrame(nullSocket(), "", clientName(1));
+        for (int group = 0; group < WA_MAX_GROUP; group++)
+        {
+            server.handleFrame(nullSocket(), clientName(0), std::string(ADD_TO_GROUP_COMMAND) +
+                                                            " group" + std::to_string(group) +
+                                                            " " + clientName(1));
+        }
+        server.publishPresence();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * WA_MAX_GROUP);
+}
+BENCHMARK(BM_ExitCleanup)->RangeMultiplier(10)->Range(10, 10000);
+
+static void BM_GroupFanOut(benchmark::State &state)
+{
+    whatsappServer server;
+    registerClients(server, state.range(0));
+    createGroup(server, "team", state.range(0));
+    for (auto _ : state)
+    {
+        server.handleFrame(nullSocket(), clientName(0), "send team hello everyone");
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_GroupFanOut)->RangeMultiplier(10)->Range(10, 10000);
+
+static void BM_CompressRoster(benchmark::State &state)
+{
+    std::string roster;
+    for (long i = 0; roster.size() + clientName(i).size() + 1 < WA_MAX_INPUT; i++)
+    {
+        roster.append(clientName(i)).append(",");
+    }
+    std::string payload;
+    for (auto _ : state)
+    {
+        std::string compressed = compress_payload(roster);
+        benchmark::DoNotOptimize(decompress_payload(compressed.data(), compressed.size(), payload));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<long>(roster.size()));
+}
+BENCHMARK(BM_CompressRoster);
+
+/**
+ * A connected socket whose other end is read and thrown away by a thread, so writing
+ * frames costs what it costs on a client socket whose client keeps up.
+ */
+struct drainedSocket
+{
+    int fds[2];
+    std::thread reader;
+
+    drainedSocket()
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        {
+            fds[0] = fds[1] = -1;
+            return;
+        }
+        reader = std::thread([this]()
+                             {
+                                 char received[1 << 16];
+                                 while (read(fds[1], received, sizeof(received)) > 0)
+                                 {
+                                 }
+                             });
+    }
+
+    ~drainedSocket()
+    {
+        close(fds[0]); //the reader reads the end of the stream and returns
+        if (reader.joinable())
+        {
+            reader.join();
+        }
+        close(fds[1]);
+    }
+};
+
+/**
+ * Writes one zero padded frame the way writeToClient did before it used writev, copying the
+ * payload into a zeroed frame, or the way it does now, writing the payload and the padding
+ * in one writev.
+ * @return false if the frame was not written whole
+ */
+static bool writeFrame(int fd, const std::string &payload, bool isCopied)
+{
+    static const char padding[WA_MAX_INPUT] = {0};
+    if (isCopied)
+    {
+        char frame[WA_MAX_INPUT];
+        memset(frame, '\0', WA_MAX_INPUT);
+        memcpy(frame, payload.data(), payload.size());
+        return write(fd, frame, WA_MAX_INPUT) == WA_MAX_INPUT;
+    }
+    iovec parts[2] = {{const_cast<char *>(payload.data()), payload.size()},
+                      {const_cast<char *>(padding), WA_MAX_INPUT - payload.size()}};
+    return writev(fd, parts, 2) == WA_MAX_INPUT;
+}
+
+static void BM_FrameWrite(benchmark::State &state, bool isCopied)
+{
+    drainedSocket socket;
+    if (socket.fds[0] < 0)
+    {
+        state.SkipWithError("socketpair failed");
+        return;
+    }
+    std::string payload(static_cast<size_t>(state.range(0)), 'x');
+    for (auto _ : state)
+    {
+        if (!writeFrame(socket.fds[0], payload, isCopied))
+        {
+            state.SkipWithError("short write");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_FrameWrite, copy, true)->Arg(16)->Arg(128)->Arg(1024)->Arg(WA_MAX_INPUT);
+BENCHMARK_CAPTURE(BM_FrameWrite, writev, false)->Arg(16)->Arg(128)->Arg(1024)->Arg(WA_MAX_INPUT);
+
+int main(int argc, char *argv[])
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    //The server prints every command it handles, so stdout is left to it
+    benchmark::ConsoleReporter results;
+    results.SetOutputStream(&std::cerr);
+    results.SetErrorStream(&std::cerr);
+    if (freopen("/dev/null", "w", stdout) == nullptr)
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks(&results);
+    benchmark::Shutdown();
+    return 0;
+}
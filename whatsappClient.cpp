@@ -1,25 +1,29 @@
-#include <zconf.h>
 #include <algorithm>
+#include <fcntl.h>
 #include "whatsappClient.h"
 #include "whatsappio.h"
 
 int main(int argc, char *argv[])
 {
-    //Example for an Input: whatsappClient Naama 127.0.0.1 8875
-    if (argc != 4)
+    //Example for an Input: whatsappClient Naama 127.0.0.1 8875 [--batch commands.txt]
+    if (argc == 4)
     {
-        print_client_usage();
-        exit(1);
+        whatsappClient client = whatsappClient(argv[1],argv[2],argv[3]);
+        client.run();
     }
-
-    whatsappClient client = whatsappClient(argv[1],argv[2],argv[3]);
-    client.run();
+    if (argc == 6 && std::string(argv[4]) == "--batch")
+    {
+        whatsappClient client = whatsappClient(argv[1],argv[2],argv[3],argv[5]);
+        client.run();
+    }
+    print_client_usage();
+    exit(1);
 }
 
-whatsappClient::whatsappClient(char* clientN, char* ipAdd,char* port)
+whatsappClient::whatsappClient(char* clientN, char* ipAdd,char* port, char* batchFile)
 {
     clientName = std::string(clientN);
-    if (!isValidName(clientName))
+    if (!is_valid_name(clientName))
     {
         print_client_usage();
         exit(1);
@@ -29,27 +33,16 @@ whatsappClient::whatsappClient(char* clientN, char* ipAdd,char* port)
     clientSetServerAddress();
     createSocket();
     connectClient();
-}
-
-/**
- * validate the name given has characters and\or digits only
- * @param name
- * @return If the name is valid returns true, false o.w
- */
-bool whatsappClient::isValidName(std::string name)
-{
-    if (name.size() > WA_MAX_INPUT)
+    if (batchFile != nullptr)
     {
-        return false;
+        openBatchFile(batchFile);
     }
-    for (char c : name)
+    //Registered: from now on the socket never blocks, what it does not take waits in outgoing
+    if (fcntl(clientFD, F_SETFL, fcntl(clientFD, F_GETFL) | O_NONBLOCK) < 0)
     {
-        if (!isalnum(c))
-        {
-            return false;
-        }
+        print_error("fcntl", errno);
+        exit(1);
     }
-    return true;
 }
 
 /**
@@ -101,12 +94,36 @@ void whatsappClient::createSocket()
 }
 
 
+/**
+ * Reads the commands from the given file instead of stdin, once the file ends the client
+ * goes back to reading commands from stdin.
+ * @param batchFile path of a file holding one command per line
+ */
+void whatsappClient::openBatchFile(char *batchFile)
+{
+    commandFD = open(batchFile, O_RDONLY);
+    if (commandFD < 0)
+    {
+        print_client_usage();
+        exit(1);
+    }
+    isBatch = true;
+}
+
 void whatsappClient::setFileDescriptors()
 {
     FD_ZERO(&readFileDescriptors);
     FD_ZERO(&writeFileDescriptors);
-    FD_SET(STDIN_FILENO, &readFileDescriptors);
+    //Stops reading commands while the pipeline is full, until feedback arrives
+    if (commandFD >= 0 && pendingCommands.size() < MAX_PIPELINED_COMMANDS)
+    {
+        FD_SET(commandFD, &readFileDescriptors);
+    }
     FD_SET(clientFD, &readFileDescriptors);
+    if (!outgoing.empty())
+    {
+        FD_SET(clientFD, &writeFileDescriptors);
+    }
 }
 
 
@@ -117,35 +134,22 @@ void whatsappClient::sendClientName()
     {
         buffer[i] = clientName.at(i);
     }
+    offer_compact_mode(buffer);
     if (write(clientFD, buffer, WA_MAX_INPUT) < 0)
     {
         print_error("write", errno);
         exit(1);
     }
-    //Getting response from the server if client name already exists
-    setFileDescriptors();
-
-    if (select(clientFD + 1, &readFileDescriptors, &writeFileDescriptors, nullptr, nullptr) < 0)
+    //Getting response from the server if client name already exists, commands typed
+    //meanwhile wait in stdin until the client is registered
+    readFromServer();
+    if (std::string(buffer) == "Failed")
     {
-        print_error("select", errno);
+        print_dup_connection();
+        close(clientFD);
         exit(1);
     }
-    if(FD_ISSET(clientFD,&readFileDescriptors)){
-
-        readFromServer();
-        if (std::string(buffer) == "Failed")
-        {
-            print_dup_connection();
-            close(clientFD);
-            exit(1);
-        }
-    }
-    if(FD_ISSET(STDIN_FILENO,&readFileDescriptors)){
-        readCommand();
-    }
-    if(FD_ISSET(clientFD, &writeFileDescriptors)){
-        writeToServer();
-    }
+    isCompact = offers_compact_mode(buffer);
 }
 
 void whatsappClient::connectClient()
@@ -186,32 +190,220 @@ void whatsappClient::readFromServer()
     }
 }
 
+/**
+ * Reads the frames that arrived from the server, without waiting for the rest of a frame.
+ * A partial frame is kept until the rest of it arrives, every whole frame is handled.
+ */
+void whatsappClient::readFrames()
+{
+    char received[WA_MAX_INPUT];
+    ssize_t bytesRead = read(clientFD, received, WA_MAX_INPUT);
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+    if (bytesRead < 1)
+    {
+        print_exit();
+        shutdown(clientFD, SHUT_RDWR);
+        close(clientFD);
+        exit(1);
+    }
+    incoming.append(received, static_cast<size_t>(bytesRead));
+    while (takeFrame())
+    {
+        //Feedback never holds ": ", a message another client sent always does, and presence
+        //pushes arrive whether or not a command is waiting
+        if (!pendingCommands.empty() && strstr(buffer, ": ") == nullptr &&
+            strncmp(buffer, PRESENCE_PREFIX, sizeof(PRESENCE_PREFIX) - 1) != 0)
+        {
+            readFeedback();
+        }
+        else //The server invoked the file descriptor and sent a message
+        {
+            printf("%s\n", buffer);
+        }
+    }
+}
+
+/**
+ * Moves the first whole frame received into buffer, decompressing a compact frame.
+ * @return true if a whole frame was received, false o.w
+ */
+bool whatsappClient::takeFrame()
+{
+    if (!isCompact)
+    {
+        if (incoming.size() < WA_MAX_INPUT)
+        {
+            return false;
+        }
+        memcpy(buffer, incoming.data(), WA_MAX_INPUT);
+        incoming.erase(0, WA_MAX_INPUT);
+        return true;
+    }
+    std::string payload;
+    int taken = take_frame(incoming, payload);
+    if (taken < 0)
+    {
+        print_error("readFrames", EPROTO);
+        exit(1);
+    }
+    if (taken == 0)
+    {
+        return false;
+    }
+    memset(buffer, '\0', WA_MAX_INPUT);
+    memcpy(buffer, payload.data(), std::min(payload.size(), static_cast<size_t>(WA_MAX_INPUT - 1)));
+    return true;
+}
+
 /***
- * Writes the buffer content to the server.
- * @param clientFD the file descriptor of the client
- * @param buffer the content to write
+ * Queues the buffer content to be written to the server.
  */
 void whatsappClient::writeToServer()
 {
-    if (write(clientFD, buffer, WA_MAX_INPUT) < 0)
+    if (isCompact)
+    {
+        outgoing.append(encode_frame(std::string(buffer)));
+        return;
+    }
+    outgoing.append(buffer, WA_MAX_INPUT);
+}
+
+/**
+ * Writes as much of the queued frames as the socket takes without blocking.
+ */
+void whatsappClient::flushToServer()
+{
+    ssize_t bytesWritten = write(clientFD, outgoing.data(), outgoing.size());
+    if (bytesWritten < 0)
     {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return;
+        }
         print_error("write", errno);
         exit(1);
     }
+    outgoing.erase(0, static_cast<size_t>(bytesWritten));
+}
+
+/**
+ * Reads what is available of the commands without waiting for a whole line. At the end of
+ * a batch file the client goes on reading stdin.
+ */
+void whatsappClient::readInput()
+{
+    char input[WA_MAX_INPUT];
+    ssize_t bytesRead = read(commandFD, input, WA_MAX_INPUT);
+    if (bytesRead > 0)
+    {
+        inputLines.append(input, static_cast<size_t>(bytesRead));
+        return;
+    }
+    if (bytesRead < 0)
+    {
+        print_error("read", errno);
+        exit(1);
+    }
+    //A last line without a newline is still a command
+    if (!inputLines.empty() && inputLines.back() != '\n')
+    {
+        inputLines.push_back('\n');
+    }
+    if (isBatch) //the batch is done, continue interactively
+    {
+        close(commandFD);
+        isBatch = false;
+        commandFD = STDIN_FILENO;
+    }
+    else //stdin is closed, only messages from the server are left to handle
+    {
+        commandFD = -1;
+    }
+}
+
+/**
+ * Sends the valid commands among the whole lines read, as long as the pipeline has room.
+ */
+void whatsappClient::sendCommands()
+{
+    size_t lineStart = 0;
+    size_t lineEnd;
+    while (pendingCommands.size() < MAX_PIPELINED_COMMANDS &&
+           (lineEnd = inputLines.find('\n', lineStart)) != std::string::npos)
+    {
+        memset(buffer, '\0', WA_MAX_INPUT);
+        memcpy(buffer, inputLines.data() + lineStart,
+               std::min(lineEnd - lineStart, static_cast<size_t>(WA_MAX_INPUT - 1)));
+        lineStart = lineEnd + 1;
+        if (readCommand())
+        {
+            writeToServer();
+            pendingCommands.push_back({commandT, isGroupUpdate, name, message});
+        }
+    }
+    inputLines.erase(0, lineStart);
 }
 
+/**
+ * Parses the command line in buffer and prints why it is invalid if it is.
+ * @return true if the command should be sent to the server, false o.w
+ */
 bool whatsappClient::readCommand()
 {
     bool isValidCommand;
 
-    fgets(buffer, WA_MAX_INPUT, stdin);
     //Case of empty string
-    *std::remove(buffer, buffer+strlen(buffer), '\n') = '\0';
     if(std::string(buffer).empty())
     {
         print_invalid_input();
         return false;
     }
+    if (std::string(buffer) == SUBSCRIBE_COMMAND)
+    {
+        /*
+            Sends a request to receive the list of currently connected client names, after
+            which the server pushes "presence +name,-name" lines as clients join and leave.
+        */
+        isGroupUpdate = false;
+        commandT = WHO; //the initial list is answered exactly like WHO
+        return true;
+    }
+    isGroupUpdate = false;
+    if (parse_who(buffer, whoPrefix, whoCursor, isValidCommand))
+    {
+        /*
+            Sends a request to receive the connected client names starting with the optional
+            prefix, continuing after the optional cursor. For example: who da david
+        */
+        commandT = WHO;
+        if (!isValidCommand)
+        {
+            print_invalid_input();
+        }
+        return isValidCommand;
+    }
+    isGroupUpdate = parse_group_update(buffer, isAddCommand, name, clients);
+    if (isGroupUpdate)
+    {
+        /*
+            Sends request to add the listed clients to, or remove them from, the group
+            “group_name”, which the sender is a member of. For example:
+            add_to_group osStaff david,eshed
+        */
+        isValidCommand = is_valid_name(name);
+        for (const auto &item : clients)
+        {
+            isValidCommand &= is_valid_name(item);
+        }
+        if (!isValidCommand)
+        {
+            printf("ERROR: failed to update group \"%s\".\n", name.c_str());
+        }
+        return isValidCommand;
+    }
     // parse the command and verify if invalid
     try
     {
@@ -232,7 +424,7 @@ bool whatsappClient::readCommand()
                 letters and digits. <list_of_client_names> is separated by comma without
                 any spaces.For example: create_group osStaff david,eshed,eytan,yair"
             */
-            isValidCommand = isValidName(name); //valid name is a must
+            isValidCommand = is_valid_name(name); //valid name is a must
             if (!isValidCommand)
             {
                 print_create_group(false, false, clientName, name);
@@ -241,7 +433,7 @@ bool whatsappClient::readCommand()
             //VERIFY VALID CLIENTS LIST
             for (auto &item1:clients)
             {
-                if (!isValidName(item1))
+                if (!is_valid_name(item1))
                 {
                     print_create_group(false, false, clientName, name);
                     return false;
@@ -262,7 +454,7 @@ bool whatsappClient::readCommand()
                 specified client. If name is a group name it sends <sender_client_name>:
                 <message> to all group members (except the sender client).
             */
-            isValidCommand = isValidName(name);
+            isValidCommand = is_valid_name(name);
             if (!isValidCommand || (name == clientName))
             {
                 print_send(false, false, clientName, name, message);
@@ -290,16 +482,32 @@ bool whatsappClient::readCommand()
     return false;
 }
 
+/**
+ * Prints the feedback in buffer for the oldest command still waiting for one.
+ */
 void whatsappClient::readFeedback()
 {
     bool commandMadeSuccessfully;
     feedback = std::string(buffer);
-    const char* s;
-    char c[WA_MAX_INPUT];
-    char* bufferP = buffer;
     std::vector<std::string> clientsList;
+    const pendingCommand command = pendingCommands.front();
+    const std::string &name = command.name;
+    const std::string &message = command.message;
+    pendingCommands.pop_front();
     //RECEIVE FEEDBACK FROM SERVER...
-    switch (commandT)
+    if (command.isGroupUpdate)
+    {
+        if (feedback == "Succeed")
+        {
+            printf("Group \"%s\" was updated successfully.\n", name.c_str());
+        }
+        else
+        {
+            printf("ERROR: failed to update group \"%s\".\n", name.c_str());
+        }
+        return;
+    }
+    switch (command.commandT)
     {
         case CREATE_GROUP:
             /*
@@ -331,15 +539,18 @@ void whatsappClient::readFeedback()
 
             if (feedback == "Failed")
             {
-                print_who_client(false, clients);
+                print_who_client(false, clientsList);
                 return;
             }
-            //Algorithm taken from the parser
-            strcpy(c, buffer);
-            s = strtok_r(c,",",&bufferP);
-            clientsList.emplace_back(s);
-            while((s = strtok_r(nullptr, ",", &bufferP)) != nullptr) {
-                clientsList.emplace_back(s);
+            //The roster arrives in frames, every frame but the last ends with a comma.
+            //Each frame is printed as it arrives, on one line with its comma, and the
+            //command keeps waiting for the next one until the last frame ends the line.
+            if (split_names(feedback, clientsList))
+            {
+                printf("%s", feedback.c_str());
+                fflush(stdout);
+                pendingCommands.push_front(command);
+                return;
             }
             print_who_client(true, clientsList);
             return;
@@ -376,47 +587,32 @@ void whatsappClient::run()
 {
     while (true)
     {
+        //WRITES THE VALID COMMANDS READ SO FAR TO THE SERVER
+        sendCommands();
         setFileDescriptors();
-        // wait for new data to arrive from any source
-        if (select(clientFD + 1, &readFileDescriptors, &writeFileDescriptors, nullptr,
-                   nullptr) < 1)
+        // wait for new data to arrive from any source. select rather than epoll: the client
+        // waits on two fds, the socket and the command input, and epoll's saving is not
+        // rescanning many of them. It would only add epoll_ctl calls when writability changes.
+        if (select(std::max(clientFD, commandFD) + 1, &readFileDescriptors, &writeFileDescriptors,
+                   nullptr, nullptr) < 1)
         {
             print_error("select", errno);
             exit(1);
         }
         //READS INPUT FROM THE CLIENT
-        if (FD_ISSET(STDIN_FILENO, &readFileDescriptors))
+        if (commandFD >= 0 && FD_ISSET(commandFD, &readFileDescriptors))
         {
-            isValCommand = readCommand();
-            if(isValCommand)
-            {
-                FD_SET(clientFD, &writeFileDescriptors);
-            }
-            else
-            {
-                //Should not write to the server
-                FD_ZERO(&writeFileDescriptors);
-            }
+            readInput();
         }
-        //WRITE COMMAND FROM THE CLIENT TO THE SERVER
         if (FD_ISSET(clientFD, &writeFileDescriptors))
         {
-            writeToServer();
+            flushToServer();
         }
         //GET FEEDBACK FROM THE SERVER AND RESPONSE ACCORDINGLY
         if (FD_ISSET(clientFD, &readFileDescriptors))
         {
-            readFromServer();
-            if(isValCommand)
-            {
-                readFeedback();
-                isValCommand = false;
-            }
-            else //The server invoked the file descriptor and sent a message
-            {
-                printf("%s\n", buffer);
-            }
+            readFrames();
         }
     }
 
-}
\ No newline at end of file
+}
@@ -5,10 +5,25 @@
 #ifndef WHATSAPPCLIENT_WHATSAPPCLIENT_H
 #define WHATSAPPCLIENT_WHATSAPPCLIENT_H
 
+#define MAX_PIPELINED_COMMANDS 64 //commands sent before their feedback has to arrive
 
+#include <deque>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <unistd.h>
 #include "whatsappio.h"
+#include "whatsappCommands.h"
+#include "whatsappCodec.h"
+
+//A command sent to the server whose feedback did not arrive yet, with what printing the
+//feedback needs
+struct pendingCommand
+{
+    command_type commandT;
+    bool isGroupUpdate;
+    std::string name;
+    std::string message;
+};
 
 class whatsappClient
 {
@@ -18,10 +33,13 @@ private:
     std::string name;
     std::string message;
     std::vector<std::string> clients;
+    bool isGroupUpdate = false; //the command is add_to_group or remove_from_group
+    bool isAddCommand = false;
+    std::string whoPrefix; //optional arguments of who
+    std::string whoCursor;
 
     std::string feedback;
     int clientFD;
-    bool isValCommand;
     // Structs:
     sockaddr_in serverAddress;
     hostent *hp;
@@ -29,6 +47,17 @@ private:
     fd_set writeFileDescriptors;
     char buffer[WA_MAX_INPUT]; //Buffer
 
+    //Where commands are read from: stdin, or a batch file until it runs out
+    int commandFD = STDIN_FILENO;
+    bool isBatch = false;
+    std::string inputLines; //read from commandFD, the last line may not be complete yet
+
+    //Commands are pipelined: sent without waiting, their feedback arrives in the same order
+    std::deque<pendingCommand> pendingCommands;
+    std::string outgoing; //frames the socket did not accept yet
+    std::string incoming; //received bytes not making up a whole frame yet
+    bool isCompact = false; //the server accepted compact frames, see whatsappCodec.h
+
     //Input given by user:
     char *ipAddress; //being validated in clientSetServerAddress
     int portNumber ; //storing port number on which the accepts connections
@@ -37,12 +66,10 @@ private:
 
 
 public:
-    whatsappClient(char *clientName, char *ipAddress, char *port);
+    whatsappClient(char *clientName, char *ipAddress, char *port, char *batchFile = nullptr);
 
     void run();
 
-    bool isValidName(std::__cxx11::basic_string<char> name);
-
     int validatePort(char *portInput);
 
     void clientSetServerAddress();
@@ -53,12 +80,24 @@ public:
 
     void setFileDescriptors();
 
+    void openBatchFile(char *batchFile);
+
     void writeToServer();
 
+    void flushToServer();
+
     void readFromServer();
 
+    void readFrames();
+
+    bool takeFrame();
+
     void sendClientName();
 
+    void readInput();
+
+    void sendCommands();
+
     bool readCommand();
 
     void readFeedback();
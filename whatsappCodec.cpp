@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include "whatsappCodec.h"
+#include "whatsappio.h"
+
+#define HASH_BITS 12 //4096 slots, plenty for a payload of WA_MAX_INPUT bytes
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 //an LZ4 block always ends with literals
+#define MATCH_START_LIMIT 12 //and no match starts in its last 12 bytes
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *position)
+{
+    uint32_t value;
+    memcpy(&value, position, sizeof(value));
+    return value;
+}
+
+/**
+ * Appends the part of a length that does not fit in the 4 bits of a sequence token.
+ * @param body the compressed body
+ * @param length what is left of the length after the 15 of the token
+ */
+static void append_length(std::string &body, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        body.push_back(static_cast<char>(255));
+    }
+    body.push_back(static_cast<char>(length));
+}
+
+/**
+ * Appends an LZ4 sequence: the literals since the last match and then the match.
+ * @param body the compressed body
+ * @param literals the bytes copied as they are
+ * @param literalCount how many of them
+ * @param offset how far back the match starts, 0 for the last sequence that has no match
+ * @param matchLength the length of the match
+ */
+static void append_sequence(std::string &body, const unsigned char *literals, size_t literalCount,
+                            size_t offset, size_t matchLength)
+{
+    size_t matchCode = offset == 0 ? 0 : matchLength - MIN_MATCH;
+    body.push_back(static_cast<char>((std::min<size_t>(literalCount, 15) << 4) |
+                                     std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15)
+    {
+        append_length(body, literalCount - 15);
+    }
+    body.append(reinterpret_cast<const char *>(literals), literalCount);
+    if (offset == 0)
+    {
+        return;
+    }
+    body.push_back(static_cast<char>(offset & 0xff));
+    body.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15)
+    {
+        append_length(body, matchCode - 15);
+    }
+}
+
+/**
+ * Compresses a payload into an LZ4 block, with one greedy pass over a hash table of the
+ * positions of 4 byte sequences. Rosters and group messages repeat a lot, a name prefix or
+ * a sentence, which is what this finds cheaply.
+ * @param payload the payload, cut at WA_MAX_INPUT bytes
+ * @return the compressed body, empty if the payload is below COMPRESSION_THRESHOLD or does
+ * not get smaller
+ */
+std::string compress_payload(const std::string &payload)
+{
+    size_t size = std::min(payload.size(), static_cast<size_t>(WA_MAX_INPUT));
+    if (size < COMPRESSION_THRESHOLD)
+    {
+        return std::string();
+    }
+    const unsigned char *input = reinterpret_cast<const unsigned char *>(payload.data());
+    uint32_t positions[1 << HASH_BITS] = {0}; //key: hash of 4 bytes , value: last position + 1
+    std::string body;
+    body.reserve(size);
+    size_t anchor = 0; //the first byte not in the body yet
+    size_t position = 0;
+    while (position + MATCH_START_LIMIT <= size && body.size() < size)
+    {
+        uint32_t sequence = read32(input + position);
+        uint32_t &slot = positions[(sequence * 2654435761u) >> (32 - HASH_BITS)];
+        size_t candidate = slot;
+        slot = static_cast<uint32_t>(position + 1);
+        if (candidate == 0 || position + 1 - candidate > MAX_OFFSET ||
+            read32(input + candidate - 1) != sequence)
+        {
+            position++;
+            continue;
+        }
+        size_t reference = candidate - 1;
+        size_t matchLength = MIN_MATCH;
+        while (position + matchLength < size - LAST_LITERALS &&
+               input[reference + matchLength] == input[position + matchLength])
+        {
+            matchLength++;
+        }
+        append_sequence(body, input + anchor, position - anchor, position - reference, matchLength);
+        position += matchLength;
+        anchor = position;
+    }
+    append_sequence(body, input + anchor, size - anchor, 0, 0);
+    return body.size() < size ? body : std::string();
+}
+
+/**
+ * Reads the part of a length that did not fit in the 4 bits of a sequence token.
+ * @return false if the body ends in the middle of the length, true o.w
+ */
+static bool read_length(const char *body, size_t bodySize, size_t &position, size_t &length)
+{
+    unsigned char extra;
+    do
+    {
+        if (position >= bodySize)
+        {
+            return false;
+        }
+        extra = static_cast<unsigned char>(body[position++]);
+        length += extra;
+    } while (extra == 255);
+    return true;
+}
+
+/**
+ * Decompresses an LZ4 block, checking every length and offset against the body and against
+ * WA_MAX_INPUT, so a malformed body is rejected rather than read or written out of bounds.
+ * @param body the compressed body
+ * @param bodySize its size
+ * @param payload set to the payload
+ * @return false if the body is malformed, true o.w
+ */
+bool decompress_payload(const char *body, size_t bodySize, std::string &payload)
+{
+    payload.clear();
+    payload.reserve(WA_MAX_INPUT);
+    size_t position = 0;
+    while (position < bodySize)
+    {
+        unsigned char token = static_cast<unsigned char>(body[position++]);
+        size_t literalCount = token >> 4;
+        if ((literalCount == 15 && !read_length(body, bodySize, position, literalCount)) ||
+            literalCount > bodySize - position || payload.size() + literalCount > WA_MAX_INPUT)
+        {
+            return false;
+        }
+        payload.append(body + position, literalCount);
+        position += literalCount;
+        if (position == bodySize) //the last sequence has no match
+        {
+            return true;
+        }
+        if (bodySize - position < 2)
+        {
+            return false;
+        }
+        size_t offset = static_cast<unsigned char>(body[position]) |
+                        static_cast<size_t>(static_cast<unsigned char>(body[position + 1])) << 8;
+        position += 2;
+        size_t matchLength = token & 15;
+        if ((matchLength == 15 && !read_length(body, bodySize, position, matchLength)) ||
+            offset == 0 || offset > payload.size() ||
+            payload.size() + matchLength + MIN_MATCH > WA_MAX_INPUT)
+        {
+            return false;
+        }
+        //Byte by byte, since a match may overlap the bytes it produces
+        size_t from = payload.size() - offset;
+        for (size_t i = 0; i < matchLength + MIN_MATCH; i++)
+        {
+            payload.push_back(payload[from + i]);
+        }
+    }
+    return false; //empty, or ends with a match
+}
+
+std::string frame_header(size_t bodySize, bool isCompressed)
+{
+    uint32_t header = htonl(static_cast<uint32_t>(bodySize) | (isCompressed ? COMPRESSED_FRAME : 0));
+    return std::string(reinterpret_cast<const char *>(&header), FRAME_HEADER_SIZE);
+}
+
+/**
+ * Builds the compact frame of a payload, compressed if that makes it smaller.
+ * @param payload the payload, cut at WA_MAX_INPUT bytes
+ * @return the header and the body
+ */
+std::string encode_frame(const std::string &payload)
+{
+    std::string compressed = compress_payload(payload);
+    if (!compressed.empty())
+    {
+        return frame_header(compressed.size(), true).append(compressed);
+    }
+    size_t size = std::min(payload.size(), static_cast<size_t>(WA_MAX_INPUT));
+    return frame_header(size, false).append(payload, 0, size);
+}
+
+/**
+ * Finds how many bytes the first compact frame received takes.
+ * @param received the bytes received so far
+ * @return the size of the frame with its header, 0 if the header did not arrive yet. A body
+ * longer than any valid one counts as empty, so the frame is taken and rejected at once
+ * instead of being waited for.
+ */
+size_t compact_frame_size(const std::string &received)
+{
+    if (received.size() < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+    uint32_t header;
+    memcpy(&header, received.data(), FRAME_HEADER_SIZE);
+    size_t bodySize = ntohl(header) & ~COMPRESSED_FRAME;
+    return bodySize > WA_MAX_INPUT ? FRAME_HEADER_SIZE : FRAME_HEADER_SIZE + bodySize;
+}
+
+/**
+ * Takes the first compact frame received, if all of it arrived.
+ * @param received the bytes received so far, the frame taken is erased from them
+ * @param payload set to the payload of the frame
+ * @return 1 if a frame was taken, 0 if it did not arrive whole yet, -1 if it is malformed
+ */
+int take_frame(std::string &received, std::string &payload)
+{
+    size_t frameSize = compact_frame_size(received);
+    if (frameSize == 0 || received.size() < frameSize)
+    {
+        return 0;
+    }
+    uint32_t header;
+    memcpy(&header, received.data(), FRAME_HEADER_SIZE);
+    header = ntohl(header);
+    size_t bodySize = header & ~COMPRESSED_FRAME;
+    bool isValid = bodySize <= WA_MAX_INPUT;
+    if (isValid && (header & COMPRESSED_FRAME) != 0)
+    {
+        isValid = decompress_payload(received.data() + FRAME_HEADER_SIZE, bodySize, payload);
+    }
+    else if (isValid)
+    {
+        payload.assign(received, FRAME_HEADER_SIZE, bodySize);
+    }
+    received.erase(0, frameSize);
+    return isValid ? 1 : -1;
+}
+
+/**
+ * Offers compact frames after the text of a fixed size handshake frame.
+ * @param frame the zero padded frame of WA_MAX_INPUT bytes
+ */
+void offer_compact_mode(char *frame)
+{
+    size_t textEnd = strnlen(frame, WA_MAX_INPUT);
+    if (textEnd + sizeof(COMPACT_MODE) < WA_MAX_INPUT)
+    {
+        memcpy(frame + textEnd + 1, COMPACT_MODE, sizeof(COMPACT_MODE));
+    }
+}
+
+/**
+ * Checks whether a fixed size handshake frame offers compact frames after its text.
+ * @param frame the frame of WA_MAX_INPUT bytes
+ * @return true if it does, false o.w
+ */
+bool offers_compact_mode(const char *frame)
+{
+    size_t textEnd = strnlen(frame, WA_MAX_INPUT);
+    return textEnd + sizeof(COMPACT_MODE) < WA_MAX_INPUT &&
+           memcmp(frame + textEnd + 1, COMPACT_MODE, sizeof(COMPACT_MODE)) == 0;
+}
@@ -0,0 +1,37 @@
+//
+// Compact frames, negotiated when a client registers: a client offers COMPACT_MODE after the
+// name in its name frame and the server accepts it after the text of its reply, where peers
+// that do not know the mode only see padding. From then on both sides send
+// uint32 header (big endian: COMPRESSED_FRAME flag | body length), body
+// instead of zero padded WA_MAX_INPUT frames. A body of COMPRESSION_THRESHOLD bytes or more
+// is LZ4 block compressed when that makes it smaller.
+//
+
+#ifndef WHATSAPPSERVER_WHATSAPPCODEC_H
+#define WHATSAPPSERVER_WHATSAPPCODEC_H
+
+#define COMPACT_MODE "compact"
+#define COMPRESSION_THRESHOLD 128 //shorter payloads are sent as they are
+#define FRAME_HEADER_SIZE 4
+#define COMPRESSED_FRAME 0x80000000u //header flag, the body is compressed
+
+#include <cstddef>
+#include <string>
+
+std::string compress_payload(const std::string &payload);
+
+bool decompress_payload(const char *body, size_t bodySize, std::string &payload);
+
+std::string frame_header(size_t bodySize, bool isCompressed);
+
+std::string encode_frame(const std::string &payload);
+
+size_t compact_frame_size(const std::string &received);
+
+int take_frame(std::string &received, std::string &payload);
+
+void offer_compact_mode(char *frame);
+
+bool offers_compact_mode(const char *frame);
+
+#endif //WHATSAPPSERVER_WHATSAPPCODEC_H
@@ -0,0 +1,202 @@
+//
+// Commands shared by the client and the server on top of the ones parse_command knows.
+//
+
+#ifndef WHATSAPPSERVER_WHATSAPPCOMMANDS_H
+#define WHATSAPPSERVER_WHATSAPPCOMMANDS_H
+
+#define ADD_TO_GROUP_COMMAND "add_to_group"
+#define REMOVE_FROM_GROUP_COMMAND "remove_from_group"
+#define SUBSCRIBE_COMMAND "subscribe"
+#define WHO_COMMAND "who"
+#define PRESENCE_PREFIX "presence " //starts the join (+name) and leave (-name) pushes
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+#include "whatsappio.h"
+
+inline bool is_alphanumeric(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+#if defined(__AVX2__)
+/**
+ * Marks the bytes of a block that fall in [low, high]. Compared as signed bytes, which is
+ * right since the ranges are ASCII and the bytes from 0x80 on are negative, below them all.
+ */
+inline __m256i in_range(__m256i bytes, char low, char high)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(static_cast<char>(low - 1))),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(high + 1)), bytes));
+}
+#endif
+
+/**
+ * Validates that a name is made of letters and digits only. Whole blocks are checked with
+ * AVX2 (32 bytes) or SSE4.2 (16 bytes) when the build targets them, e.g. with -DWA_NATIVE=ON,
+ * and the rest byte by byte.
+ * @param name the client or group name
+ * @return If the name is valid returns true, false o.w
+ */
+inline bool is_valid_name(const std::string &name)
+{
+    if (name.empty() || name.size() > WA_MAX_INPUT)
+    {
+        return false;
+    }
+    const char *position = name.data();
+    const char *end = position + name.size();
+#if defined(__AVX2__)
+    for (; end - position >= 32; position += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(position));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(in_range(bytes, 'a', 'z'), in_range(bytes, 'A', 'Z')),
+                                        in_range(bytes, '0', '9'));
+        if (_mm256_movemask_epi8(valid) != -1)
+        {
+            return false;
+        }
+    }
+#elif defined(__SSE4_2__)
+    const __m128i ranges = _mm_setr_epi8('a', 'z', 'A', 'Z', '0', '9', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - position >= 16; position += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(position));
+        //The index of the first byte outside the ranges, 16 if there is none
+        if (_mm_cmpestri(ranges, 6, bytes, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY) != 16)
+        {
+            return false;
+        }
+    }
+#endif
+    bool isValid = true;
+    for (; position < end; position++)
+    {
+        isValid &= is_alphanumeric(*position);
+    }
+    return isValid;
+}
+
+/**
+ * Appends the comma separated names of a list, in place and without copying the list.
+ * @param list the names separated by comma without any spaces
+ * @param names the names found are appended here
+ * @return true if the list ends with a comma, meaning more names follow, false o.w
+ */
+inline bool split_names(const std::string &list, std::vector<std::string> &names)
+{
+    size_t start = 0;
+    size_t comma;
+    while ((comma = list.find(',', start)) != std::string::npos)
+    {
+        names.emplace_back(list, start, comma - start);
+        start = comma + 1;
+    }
+    if (start < list.size())
+    {
+        names.emplace_back(list, start);
+        return false;
+    }
+    return start > 0;
+}
+
+/**
+ * Finds the next space separated token of a command.
+ * @param command the command
+ * @param position where to look from, moved past the token found
+ * @param tokenStart set to where the token starts
+ * @return the length of the token, 0 if there are no more tokens
+ */
+inline size_t next_token(const std::string &command, size_t &position, size_t &tokenStart)
+{
+    tokenStart = command.find_first_not_of(' ', position);
+    if (tokenStart == std::string::npos)
+    {
+        position = command.size();
+        return 0;
+    }
+    position = std::min(command.find(' ', tokenStart), command.size());
+    return position - tokenStart;
+}
+
+/**
+ * Parses "add_to_group <group_name> <list_of_client_names>" and
+ * "remove_from_group <group_name> <list_of_client_names>", where the list is separated by
+ * comma without any spaces.
+ * @param command the command as typed
+ * @param isAdd set to true for add_to_group and false for remove_from_group
+ * @param groupName set to the group name, empty if the command is malformed
+ * @param members set to the listed names, empty if the command is malformed
+ * @return true if the command is one of the two group update commands, false o.w
+ */
+inline bool parse_group_update(const std::string &command, bool &isAdd, std::string &groupName,
+                               std::vector<std::string> &members)
+{
+    size_t position = 0;
+    size_t tokenStart;
+    size_t length = next_token(command, position, tokenStart);
+    if (length == 0)
+    {
+        return false;
+    }
+    isAdd = command.compare(tokenStart, length, ADD_TO_GROUP_COMMAND) == 0;
+    if (!isAdd && command.compare(tokenStart, length, REMOVE_FROM_GROUP_COMMAND) != 0)
+    {
+        return false;
+    }
+    groupName.clear();
+    members.clear();
+    length = next_token(command, position, tokenStart);
+    groupName.assign(command, tokenStart == std::string::npos ? 0 : tokenStart, length);
+    length = next_token(command, position, tokenStart);
+    size_t listStart = tokenStart;
+    if (length == 0 || next_token(command, position, tokenStart) != 0 ||
+        split_names(command.substr(listStart, length), members))
+    {
+        groupName.clear();
+        members.clear();
+    }
+    return true;
+}
+
+/**
+ * Parses "who [prefix] [cursor]": only names starting with the prefix are listed, and only
+ * names after the cursor, so a client can continue from the last name it received.
+ * @param command the command as typed
+ * @param prefix set to the prefix, empty lists every name
+ * @param cursor set to the cursor, empty lists from the first name
+ * @param isValid set to false if the arguments are malformed
+ * @return true if the command is who, false o.w
+ */
+inline bool parse_who(const std::string &command, std::string &prefix, std::string &cursor,
+                      bool &isValid)
+{
+    size_t position = 0;
+    size_t tokenStart;
+    size_t length = next_token(command, position, tokenStart);
+    if (length == 0 || command.compare(tokenStart, length, WHO_COMMAND) != 0)
+    {
+        return false;
+    }
+    prefix.clear();
+    cursor.clear();
+    if ((length = next_token(command, position, tokenStart)) != 0)
+    {
+        prefix.assign(command, tokenStart, length);
+    }
+    if ((length = next_token(command, position, tokenStart)) != 0)
+    {
+        cursor.assign(command, tokenStart, length);
+    }
+    isValid = next_token(command, position, tokenStart) == 0 &&
+              (prefix.empty() || is_valid_name(prefix)) && (cursor.empty() || is_valid_name(cursor));
+    return true;
+}
+
+#endif //WHATSAPPSERVER_WHATSAPPCOMMANDS_H
@@ -0,0 +1,501 @@
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "whatsappFederation.h"
+#include "whatsappCommands.h"
+#include "whatsappio.h"
+
+/**
+ * Joins the cluster: listens on the peer port of this server and places every server on the
+ * hash ring. Links to the other servers are opened when first used.
+ * @param peerPorts the peer ports of the cluster separated by comma, this server's first
+ * @param onRequest answers the requests of other servers that are not about the directory
+ * @param onFailure exits the server when a link to another server fails
+ */
+whatsappFederation::whatsappFederation(const char *peerPorts, requestHandler onRequest,
+                                       std::function<void(int)> onFailure) :
+        handler(std::move(onRequest)), exitServer(std::move(onFailure))
+{
+    std::vector<std::string> ports;
+    split_names(peerPorts, ports);
+    try
+    {
+        for (const std::string &port : ports)
+        {
+            nodes.push_back(std::stoi(port));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        nodes.clear();
+    }
+    if (nodes.empty())
+    {
+        print_server_usage();
+        exit(1);
+    }
+    node = nodes.front();
+    //Every server builds the same ring whatever order it was given the ports in
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    for (int peer : nodes)
+    {
+        for (int point = 0; point < VIRTUAL_NODES; point++)
+        {
+            ring[hashKey(std::to_string(peer) + "#" + std::to_string(point))] = peer;
+        }
+    }
+    sockaddr_in peerAddress;
+    memset(&peerAddress, 0, sizeof(peerAddress));
+    peerAddress.sin_family = AF_INET;
+    peerAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    peerAddress.sin_port = htons(static_cast<uint16_t>(node));
+    listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0 ||
+        bind(listenSocket, (struct sockaddr *) &peerAddress, sizeof(peerAddress)) < 0 ||
+        listen(listenSocket, static_cast<int>(nodes.size())) < 0)
+    {
+        print_fail_connection();
+        exit(1);
+    }
+}
+
+/**
+ * FNV-1a, cheap and spreads short names well enough for placing them on the ring.
+ * @param key the name or ring point
+ * @return the hash of the key
+ */
+uint32_t whatsappFederation::hashKey(const std::string &key)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int whatsappFederation::self() const
+{
+    return node;
+}
+
+const std::vector<int> &whatsappFederation::cluster() const
+{
+    return nodes;
+}
+
+/**
+ * Finds the server keeping the owner of a name: the first ring point after its hash.
+ * @param name the client or group name
+ * @return the node of the home server
+ */
+int whatsappFederation::homeNode(const std::string &name) const
+{
+    auto point = ring.lower_bound(hashKey(name));
+    return point == ring.end() ? ring.begin()->second : point->second;
+}
+
+/**
+ * Returns the link requests to the given server are sent on, connecting it if needed. The
+ * servers of a cluster run on the same host.
+ * @param peer the node of the server
+ * @return the link, nullptr if the server cannot be reached
+ */
+peerLink *whatsappFederation::linkTo(int peer)
+{
+    peerLink &link = outgoing[peer];
+    if (link.fd >= 0)
+    {
+        return &link;
+    }
+    if (std::chrono::steady_clock::now() < link.retryAt)
+    {
+        return nullptr;
+    }
+    sockaddr_in peerAddress;
+    memset(&peerAddress, 0, sizeof(peerAddress));
+    peerAddress.sin_family = AF_INET;
+    peerAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    peerAddress.sin_port = htons(static_cast<uint16_t>(peer));
+    link.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (link.fd < 0 || connect(link.fd, (struct sockaddr *) &peerAddress, sizeof(peerAddress)) < 0)
+    {
+        dropLink(link);
+        return nullptr;
+    }
+    return &link;
+}
+
+/**
+ * Closes a link to a server that failed, what was queued on it is lost. The server is
+ * connected again on the first use after PEER_RETRY_SECONDS.
+ * @param link the link
+ */
+void whatsappFederation::dropLink(peerLink &link)
+{
+    if (link.fd >= 0)
+    {
+        close(link.fd);
+    }
+    link.fd = -1;
+    link.received.clear();
+    link.handled = 0;
+    link.pending.clear();
+    link.retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(PEER_RETRY_SECONDS);
+}
+
+/**
+ * Reads what arrived on a link without waiting for more.
+ * @param link the link
+ * @return false if the other server closed the link, true o.w
+ */
+bool whatsappFederation::receive(peerLink &link)
+{
+    char received[WA_MAX_INPUT];
+    ssize_t bytesRead = read(link.fd, received, WA_MAX_INPUT);
+    if (bytesRead < 1)
+    {
+        return false;
+    }
+    link.received.append(received, static_cast<size_t>(bytesRead));
+    return true;
+}
+
+/**
+ * Writes to a link, without a SIGPIPE if the other server is gone.
+ * @param link the link
+ * @param data what to write
+ * @return false if the other server is gone, true o.w
+ */
+bool whatsappFederation::writeLink(peerLink &link, const std::string &data)
+{
+    size_t totalBytes = 0;
+    while (totalBytes < data.size())
+    {
+        ssize_t bytesWritten = send(link.fd, data.data() + totalBytes, data.size() - totalBytes,
+                                    MSG_NOSIGNAL);
+        if (bytesWritten < 0 && errno != EINTR)
+        {
+            return false;
+        }
+        totalBytes += static_cast<size_t>(std::max<ssize_t>(bytesWritten, 0));
+    }
+    return true;
+}
+
+/**
+ * Takes the next whole line read on a link.
+ * @param link the link
+ * @param line set to the line, without its newline
+ * @return false if no whole line was read yet, true o.w
+ */
+bool whatsappFederation::takeLine(peerLink &link, std::string &line)
+{
+    size_t lineEnd = link.received.find('\n', link.handled);
+    if (lineEnd == std::string::npos)
+    {
+        //Drops the handled lines at once rather than one by one
+        link.received.erase(0, link.handled);
+        link.handled = 0;
+        return false;
+    }
+    line.assign(link.received, link.handled, lineEnd - link.handled);
+    link.handled = lineEnd + 1;
+    return true;
+}
+
+/**
+ * Answers a request of another server, the directory requests here and the rest through the
+ * server. Never sends a request itself, so answering never waits on another server.
+ * @param request the request line
+ * @param reply set to the reply line
+ * @return false if the request has no reply, true o.w
+ */
+bool whatsappFederation::answer(const std::string &request, std::string &reply)
+{
+    size_t position = 0;
+    size_t tokenStart;
+    size_t length = next_token(request, position, tokenStart);
+    std::string command(request, tokenStart == std::string::npos ? 0 : tokenStart, length);
+    std::string name;
+    length = next_token(request, position, tokenStart);
+    if (length != 0)
+    {
+        name.assign(request, tokenStart, length);
+    }
+    if (command == CLAIM_REQUEST)
+    {
+        length = next_token(request, position, tokenStart);
+        bool isGroup = request.compare(tokenStart, length, "group") == 0;
+        int owner = std::atoi(request.c_str() + position);
+        reply = directory.emplace(name, directoryEntry{isGroup, owner}).second ? "OK" : "TAKEN";
+        return true;
+    }
+    if (command == RELEASE_REQUEST)
+    {
+        auto entry = directory.find(name);
+        if (entry != directory.end() && entry->second.node == std::atoi(request.c_str() + position))
+        {
+            directory.erase(entry);
+        }
+        return false;
+    }
+    if (command == WHERE_REQUEST)
+    {
+        std::vector<std::string> names;
+        split_names(name, names);
+        reply.clear();
+        for (const std::string &owned : names)
+        {
+            auto entry = directory.find(owned);
+            int owner = entry == directory.end() ? 0 :
+                        entry->second.isGroup ? -entry->second.node : entry->second.node;
+            reply.append(std::to_string(owner)).append(",");
+        }
+        if (!reply.empty())
+        {
+            reply.pop_back();
+        }
+        return true;
+    }
+    return handler(request, reply);
+}
+
+void whatsappFederation::acceptPeer()
+{
+    peerLink link;
+    link.fd = accept(listenSocket, nullptr, nullptr);
+    if (link.fd < 0)
+    {
+        print_error("accept", errno);
+        exitServer(1);
+    }
+    incoming.push_back(link);
+}
+
+/**
+ * Adds the peer port and the links other servers send requests on to a read set.
+ * @param readFDSet the set
+ * @param maxFD the highest socket in the set so far
+ * @return the highest socket in the set
+ */
+int whatsappFederation::fdSetPeers(fd_set &readFDSet, int maxFD) const
+{
+    FD_SET(listenSocket, &readFDSet);
+    maxFD = std::max(maxFD, listenSocket);
+    for (const peerLink &link : incoming)
+    {
+        FD_SET(link.fd, &readFDSet);
+        maxFD = std::max(maxFD, link.fd);
+    }
+    return maxFD;
+}
+
+/**
+ * Answers the requests that arrived on the ready links and accepts new links.
+ * @param readFDSet the set select marked the ready sockets in
+ */
+void whatsappFederation::servePeers(fd_set &readFDSet)
+{
+    std::string line;
+    std::string reply;
+    for (peerLink &link : incoming)
+    {
+        if (!FD_ISSET(link.fd, &readFDSet))
+        {
+            continue;
+        }
+        if (!receive(link)) //the other server is gone, it reconnects when it is back
+        {
+            close(link.fd);
+            link.fd = -1;
+            continue;
+        }
+        while (takeLine(link, line))
+        {
+            if (answer(line, reply) && !writeLink(link, reply + "\n"))
+            {
+                close(link.fd);
+                link.fd = -1;
+                break;
+            }
+        }
+    }
+    incoming.erase(std::remove_if(incoming.begin(), incoming.end(),
+                                  [](const peerLink &link) { return link.fd < 0; }),
+                   incoming.end());
+    if (FD_ISSET(listenSocket, &readFDSet))
+    {
+        acceptPeer();
+    }
+}
+
+/**
+ * Sends a request to another server and waits for its reply, answering the requests of
+ * other servers meanwhile. The messages posted to the server before are sent first.
+ * @param peer the node of the server
+ * @param line the request
+ * @return the reply, empty if the server cannot be reached or does not reply in time
+ */
+std::string whatsappFederation::request(int peer, const std::string &line)
+{
+    peerLink *link = linkTo(peer);
+    if (link == nullptr)
+    {
+        return std::string();
+    }
+    link->pending.append(line).append("\n");
+    if (!writeLink(*link, link->pending))
+    {
+        dropLink(*link);
+        return std::string();
+    }
+    link->pending.clear();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(PEER_TIMEOUT_SECONDS);
+    std::string reply;
+    while (!takeLine(*link, reply))
+    {
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        timeval timeout = {static_cast<time_t>(std::max<long long>(left, 0) / 1000000),
+                           static_cast<suseconds_t>(std::max<long long>(left, 0) % 1000000)};
+        fd_set readySet;
+        FD_ZERO(&readySet);
+        FD_SET(link->fd, &readySet);
+        int maxFD = fdSetPeers(readySet, link->fd);
+        int ready = select(maxFD + 1, &readySet, nullptr, nullptr, &timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            print_error("select", errno);
+            exitServer(1);
+        }
+        if (ready == 0 || (ready > 0 && FD_ISSET(link->fd, &readySet) && !receive(*link)))
+        {
+            dropLink(*link); //gone or stuck, a late reply must not answer the next request
+            return std::string();
+        }
+        if (ready > 0)
+        {
+            servePeers(readySet);
+        }
+    }
+    return reply;
+}
+
+/**
+ * Queues a message that has no reply, every server gets the messages queued for it in one
+ * write at the end of the loop.
+ * @param peer the node of the server
+ * @param line the message
+ * @return false if the server cannot be reached, true o.w
+ */
+bool whatsappFederation::post(int peer, const std::string &line)
+{
+    peerLink *link = linkTo(peer);
+    if (link == nullptr)
+    {
+        return false;
+    }
+    link->pending.append(line).append("\n");
+    return true;
+}
+
+void whatsappFederation::flush()
+{
+    for (auto &link : outgoing)
+    {
+        if (link.second.pending.empty())
+        {
+            continue;
+        }
+        if (writeLink(link.second, link.second.pending))
+        {
+            link.second.pending.clear();
+        }
+        else
+        {
+            dropLink(link.second);
+        }
+    }
+}
+
+/**
+ * Makes this server the owner of a name, unless a client or a group anywhere in the
+ * cluster already has it.
+ * @param name the client or group name
+ * @param isGroup true for a group name, false for a client name
+ * @return true if the name was free, false o.w
+ */
+bool whatsappFederation::claim(const std::string &name, bool isGroup)
+{
+    int home = homeNode(name);
+    if (home == node)
+    {
+        return directory.emplace(name, directoryEntry{isGroup, node}).second;
+    }
+    return request(home, std::string(CLAIM_REQUEST " ") + name + (isGroup ? " group " : " client ") +
+                         std::to_string(node)) == "OK";
+}
+
+/**
+ * Gives up a name this server owns.
+ * @param name the client or group name
+ */
+void whatsappFederation::release(const std::string &name)
+{
+    int home = homeNode(name);
+    if (home != node)
+    {
+        post(home, std::string(RELEASE_REQUEST " ") + name + " " + std::to_string(node));
+        return;
+    }
+    auto entry = directory.find(name);
+    if (entry != directory.end() && entry->second.node == node)
+    {
+        directory.erase(entry);
+    }
+}
+
+/**
+ * Finds the owners of names, with one request per home server.
+ * @param names the client or group names
+ * @return for every name the node of its client, minus the node of its group, 0 if none
+ */
+std::vector<int> whatsappFederation::locate(const std::vector<std::string> &names)
+{
+    std::vector<int> owners(names.size(), 0);
+    std::map<int, std::vector<size_t>> byHome; //key: home node , value: indices of its names
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        byHome[homeNode(names[i])].push_back(i);
+    }
+    for (const auto &home : byHome)
+    {
+        std::string list;
+        for (size_t i : home.second)
+        {
+            list.append(names[i]).append(",");
+        }
+        list.pop_back();
+        std::string reply;
+        if (home.first == node)
+        {
+            answer(std::string(WHERE_REQUEST " ") + list, reply);
+        }
+        else
+        {
+            reply = request(home.first, std::string(WHERE_REQUEST " ") + list);
+        }
+        std::vector<std::string> found;
+        split_names(reply, found);
+        for (size_t j = 0; j < found.size() && j < home.second.size(); j++)
+        {
+            owners[home.second[j]] = std::atoi(found[j].c_str());
+        }
+    }
+    return owners;
+}
@@ -0,0 +1,113 @@
+//
+// Lets several servers act as one: every client and group name has a home server, picked
+// by consistent hashing of the name, which records which server owns it. Servers talk over
+// persistent links on their peer ports with one line per message:
+//   CLAIM <name> <kind> <node>     owns the name at its home, replied OK or TAKEN
+//   RELEASE <name> <node>          drops the name at its home, no reply
+//   WHERE <name,name,...>          replied with the owner of every name: the node of a
+//                                  client, minus the node of a group, 0 if nobody owns it
+// The server answers the requests on its own state (see whatsappServer::handlePeerRequest).
+// Only the server serving a client sends requests and waits for their reply, while it keeps
+// answering the requests of others, so two servers never wait for each other. A server that
+// cannot be reached, or does not reply within PEER_TIMEOUT_SECONDS, fails the request with an
+// empty reply and is connected again once PEER_RETRY_SECONDS passed.
+//
+
+#ifndef WHATSAPPSERVER_WHATSAPPFEDERATION_H
+#define WHATSAPPSERVER_WHATSAPPFEDERATION_H
+
+#define VIRTUAL_NODES 64 //ring points per server, so the names spread evenly
+#define PEER_TIMEOUT_SECONDS 2 //how long a reply is waited for
+#define PEER_RETRY_SECONDS 1 //how long an unreachable server is not connected again
+#define CLAIM_REQUEST "CLAIM"
+#define RELEASE_REQUEST "RELEASE"
+#define WHERE_REQUEST "WHERE"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <sys/select.h>
+#include <vector>
+
+//A connection to another server, holding what was read but not handled yet and what is
+//queued to be written at the end of the loop
+struct peerLink
+{
+    int fd = -1;
+    std::string received;
+    size_t handled = 0; //received up to here is already handled
+    std::string pending;
+    std::chrono::steady_clock::time_point retryAt; //not connected before, after a failure
+};
+
+//The owner of a name, kept by the home server of the name
+struct directoryEntry
+{
+    bool isGroup;
+    int node;
+};
+
+class whatsappFederation
+{
+public:
+    //Answers a request of another server on the server state, returns false if the request
+    //has no reply
+    typedef std::function<bool(const std::string &request, std::string &reply)> requestHandler;
+
+private:
+    int node; //the peer port of this server, names the server in the cluster
+    int listenSocket;
+    std::vector<int> nodes; //every server of the cluster, sorted
+    std::map<uint32_t, int> ring; //key: ring point , value: the node at it
+    std::map<std::string, directoryEntry> directory; //the names this server is home to
+    std::map<int, peerLink> outgoing; //key: node , value: the link its requests are sent on
+    std::vector<peerLink> incoming; //links other servers send their requests on
+    requestHandler handler;
+    std::function<void(int)> exitServer;
+
+    static uint32_t hashKey(const std::string &key);
+
+    peerLink *linkTo(int peer);
+
+    void dropLink(peerLink &link);
+
+    bool receive(peerLink &link);
+
+    bool writeLink(peerLink &link, const std::string &data);
+
+    bool answer(const std::string &request, std::string &reply);
+
+    void acceptPeer();
+
+public:
+    whatsappFederation(const char *peerPorts, requestHandler onRequest,
+                       std::function<void(int)> onFailure);
+
+    int self() const;
+
+    const std::vector<int> &cluster() const;
+
+    int homeNode(const std::string &name) const;
+
+    int fdSetPeers(fd_set &readFDSet, int maxFD) const;
+
+    void servePeers(fd_set &readFDSet);
+
+    std::string request(int peer, const std::string &line);
+
+    bool post(int peer, const std::string &line);
+
+    void flush();
+
+    bool claim(const std::string &name, bool isGroup);
+
+    void release(const std::string &name);
+
+    std::vector<int> locate(const std::vector<std::string> &names);
+
+    static bool takeLine(peerLink &link, std::string &line);
+};
+
+#endif //WHATSAPPSERVER_WHATSAPPFEDERATION_H
@@ -0,0 +1,126 @@
+#include <chrono>
+#include <cstring>
+#include "whatsappRecorder.h"
+#include "whatsappio.h"
+
+/**
+ * Opens the log for writing and starts the background writer, so the server never waits
+ * on the disk.
+ * @param path the log file to create
+ */
+whatsappRecorder::whatsappRecorder(const char *path)
+{
+    logFile = fopen(path, "wb");
+    if (logFile == nullptr || fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, logFile) != RECORD_MAGIC_SIZE)
+    {
+        print_error("fopen", errno);
+        exit(1);
+    }
+    writer = std::thread(&whatsappRecorder::writeRecords, this);
+}
+
+/**
+ * Writes every record still pending and closes the log.
+ */
+whatsappRecorder::~whatsappRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        stopping = true;
+    }
+    pendingReady.notify_one();
+    writer.join();
+    fclose(logFile);
+}
+
+/**
+ * Queues a received frame for the writer thread.
+ * @param connectionId the connection the frame arrived on
+ * @param kind whether the frame is a connecting client name or a command
+ * @param frame the received bytes
+ * @param frameSize how many of the bytes to keep
+ */
+void whatsappRecorder::record(uint32_t connectionId, record_kind kind, const char *frame,
+                              size_t frameSize)
+{
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending.push_back({now, connectionId, kind, std::string(frame, frameSize)});
+    }
+    pendingReady.notify_one();
+}
+
+void whatsappRecorder::writeRecords()
+{
+    std::vector<frameRecord> toWrite;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pendingMutex);
+            pendingReady.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) //stopping and nothing left to write
+            {
+                break;
+            }
+            toWrite.swap(pending);
+        }
+        for (const frameRecord &record : toWrite)
+        {
+            uint16_t length = static_cast<uint16_t>(record.payload.size());
+            uint8_t kind = record.kind;
+            fwrite(&record.timestampMicros, sizeof(record.timestampMicros), 1, logFile);
+            fwrite(&record.connectionId, sizeof(record.connectionId), 1, logFile);
+            fwrite(&kind, sizeof(kind), 1, logFile);
+            fwrite(&length, sizeof(length), 1, logFile);
+            fwrite(record.payload.data(), 1, length, logFile);
+        }
+        toWrite.clear();
+    }
+    fflush(logFile);
+}
+
+/**
+ * Opens a recorded log for reading.
+ * @param path the log file
+ * @return the log positioned at its first record, nullptr if it is not a recorded log
+ */
+FILE *whatsappRecorder::openLog(const char *path)
+{
+    char magic[RECORD_MAGIC_SIZE];
+    FILE *log = fopen(path, "rb");
+    if (log == nullptr)
+    {
+        return nullptr;
+    }
+    if (fread(magic, 1, RECORD_MAGIC_SIZE, log) != RECORD_MAGIC_SIZE ||
+        memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0)
+    {
+        fclose(log);
+        return nullptr;
+    }
+    return log;
+}
+
+/**
+ * Reads the next record of a log.
+ * @param log a log opened by openLog
+ * @param record filled with the record read
+ * @return false at the end of the log or on a truncated record, true o.w
+ */
+bool whatsappRecorder::readRecord(FILE *log, frameRecord &record)
+{
+    uint8_t kind;
+    uint16_t length;
+    if (fread(&record.timestampMicros, sizeof(record.timestampMicros), 1, log) != 1 ||
+        fread(&record.connectionId, sizeof(record.connectionId), 1, log) != 1 ||
+        fread(&kind, sizeof(kind), 1, log) != 1 ||
+        fread(&length, sizeof(length), 1, log) != 1)
+    {
+        return false;
+    }
+    record.kind = static_cast<record_kind>(kind);
+    record.payload.resize(length);
+    return length == 0 || fread(&record.payload[0], 1, length, log) == length;
+}
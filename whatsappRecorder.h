@@ -0,0 +1,59 @@
+//
+// Records the frames a server receives into a compact binary log, and reads them back for
+// replay. A log is the RECORD_MAGIC header followed by records of:
+// uint64 timestamp (microseconds), uint32 connection id, uint8 kind, uint16 length, payload.
+//
+
+#ifndef WHATSAPPSERVER_WHATSAPPRECORDER_H
+#define WHATSAPPSERVER_WHATSAPPRECORDER_H
+
+#define RECORD_MAGIC "WAREC1"
+#define RECORD_MAGIC_SIZE 6
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum record_kind : uint8_t
+{
+    RECORD_CONNECT, //payload is the name sent by a newly accepted connection
+    RECORD_FRAME //payload is a command frame received from a registered connection
+};
+
+struct frameRecord
+{
+    uint64_t timestampMicros;
+    uint32_t connectionId;
+    record_kind kind;
+    std::string payload;
+};
+
+class whatsappRecorder
+{
+private:
+    FILE *logFile;
+    std::vector<frameRecord> pending; //filled by the server, drained by the writer thread
+    std::mutex pendingMutex;
+    std::condition_variable pendingReady;
+    bool stopping = false;
+    std::thread writer;
+
+    void writeRecords();
+
+public:
+    explicit whatsappRecorder(const char *path);
+
+    ~whatsappRecorder();
+
+    void record(uint32_t connectionId, record_kind kind, const char *frame, size_t frameSize);
+
+    static FILE *openLog(const char *path);
+
+    static bool readRecord(FILE *log, frameRecord &record);
+};
+
+#endif //WHATSAPPSERVER_WHATSAPPRECORDER_H
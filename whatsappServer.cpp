@@ -1,20 +1,52 @@
-#include <fcgios.h>
+#include <unistd.h>
 #include <algorithm>
-#include <zconf.h>
+#include <chrono>
+#include <csignal>
+#include <fcntl.h>
+#include <iterator>
+#include <thread>
+#include <sys/uio.h>
 #include "whatsappServer.h"
+#include "whatsappTrace.h"
 
 
+#ifndef WA_NO_MAIN //the benchmarks link the server without its main
 int main(int argc, char *argv[])
 {
-    //Example for an Input: whatsappServer 8875
-    if (argc != 2)
+    //Example for an Input: whatsappServer 8875 [--record traffic.log] [--federate 9875,9876]
+    //                    or: whatsappServer --replay traffic.log [speedup]
+    if ((argc == 3 || argc == 4) && std::string(argv[1]) == "--replay")
+    {
+        whatsappServer server = whatsappServer();
+        server.replay(argv[2], argc == 4 ? server.validateSpeedup(argv[3]) : 1);
+        exit(0);
+    }
+    bool validOptions = argc >= 2 && argc % 2 == 0;
+    for (int option = 2; option < argc; option += 2)
+    {
+        validOptions &= std::string(argv[option]) == "--record" ||
+                        std::string(argv[option]) == "--federate";
+    }
+    if (!validOptions)
     {
         print_server_usage();
         exit(1);
     }
     whatsappServer server = whatsappServer(argv[1]);
+    for (int option = 2; option < argc; option += 2)
+    {
+        if (std::string(argv[option]) == "--record")
+        {
+            server.startRecording(argv[option + 1]);
+        }
+        else
+        {
+            server.federate(argv[option + 1]);
+        }
+    }
     server.run();
 }
+#endif //WA_NO_MAIN
 
 whatsappServer::whatsappServer(char *port)
 {
@@ -23,6 +55,35 @@ whatsappServer::whatsappServer(char *port)
     setMainSocket();
 }
 
+/**
+ * A server without sockets, its clients only exist in a replayed log.
+ */
+whatsappServer::whatsappServer() : mainSocket(-1), portNumber(0), clientFD(-1)
+{
+}
+
+/**
+ * Checks the given replay speedup: 1 replays at the recorded pace, 0 as fast as possible
+ * @param speedupInput the given by input speedup
+ * @return the speedup as a double
+ */
+double whatsappServer::validateSpeedup(char *speedupInput)
+{
+    try
+    {
+        double speedup = std::stod(speedupInput);
+        if (speedup >= 0)
+        {
+            return speedup;
+        }
+    }
+    catch (const std::exception &e)
+    {
+    }
+    print_server_usage();
+    exit(1);
+}
+
 int whatsappServer::validatePort(char *portInput)
 {
     try
@@ -78,20 +139,55 @@ void whatsappServer::setFileDescriptors()
     FD_SET(STDIN_FILENO, &readFDSet);
 }
 
+/**
+ * Adds the client sockets to the read set, and the ones with frames left to write to the
+ * write set. A client out of tokens is left out, so its frames wait in the kernel until its
+ * bucket refills, and the select timeout is set to the earliest refill. A client that
+ * already has a whole frame read is not read from either, its frames are handled first.
+ * @return the highest socket added
+ */
 int whatsappServer::fdSetClients()
 {
     int maxFD = mainSocket;
+    double earliestRefill = -1; //seconds until the first throttled client gets a token
+    FD_ZERO(&writeFDSet);
+    hasBacklog = false;
     //add active sockets to set
-    for (const auto &client:clientSockets)
+    for (const auto &connection : connections)
     {
-        if (client.second > 0)
+        const clientConnection &client = connection.second;
+        if (client.isClosed)
         {
-            FD_SET(client.second, &readFDSet);
+            continue;
         }
-        if(maxFD < client.second)
+        maxFD = std::max(maxFD, connection.first);
+        if (!client.outgoing.empty())
         {
-            maxFD = client.second;
+            FD_SET(connection.first, &writeFDSet);
         }
+        double tokens = client.name.empty() ? 1 : availableTokens(client.name);
+        if (tokens < 1)
+        {
+            double refill = (1 - tokens) / CLIENT_RATE_PER_SECOND;
+            if (earliestRefill < 0 || refill < earliestRefill)
+            {
+                earliestRefill = refill;
+            }
+            continue;
+        }
+        if (hasWholeFrame(client))
+        {
+            hasBacklog = true;
+            continue;
+        }
+        FD_SET(connection.first, &readFDSet);
+    }
+    isThrottled = earliestRefill >= 0;
+    if (isThrottled)
+    {
+        long refillMicros = static_cast<long>(earliestRefill * 1000000) + 1;
+        throttleTimeout.tv_sec = refillMicros / 1000000;
+        throttleTimeout.tv_usec = refillMicros % 1000000;
     }
     return maxFD;
 }
@@ -103,283 +199,1273 @@ void whatsappServer::serverInput()
     if (std::string(serverInputBuffer) == "EXIT\n")
     {
         print_exit();
-        exit(0);
+        exitServer(0);
     }
     print_invalid_input();
 }
 
-void whatsappServer::readFromClient(int clientFd)
+/**
+ * Exits once the recorded frames are written and the trace is exported, so a server that
+ * fails still leaves a log that replays up to the failure.
+ * @param status the exit status
+ */
+void whatsappServer::exitServer(int status)
+{
+    WA_TRACE_EXPORT("whatsappTrace.json");
+    recorder.reset(); //flushes the recorded frames
+    exit(status);
+}
+
+/**
+ * Reads what arrived from a client without waiting for the rest of a frame, at most a batch
+ * of frames so a flooding client leaves the rest in the kernel.
+ * @param clientFd the socket of the client
+ * @param connection its buffers, closed if the client disconnected
+ */
+void whatsappServer::receiveFromClient(int clientFd, clientConnection &connection)
+{
+    char received[CLIENT_BATCH_FRAMES * WA_MAX_INPUT];
+    ssize_t bytesRead = read(clientFd, received, sizeof(received));
+    if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if (bytesRead < 1)
+    {
+        connection.isClosed = true;
+        return;
+    }
+    if (!connection.isLeaving)
+    {
+        connection.received.append(received, static_cast<size_t>(bytesRead));
+    }
+}
+
+/**
+ * Decides whether a whole frame of the client was read, in the framing it registered with.
+ * @param connection the buffers of the client
+ * @return true if a whole frame was read, false o.w
+ */
+bool whatsappServer::hasWholeFrame(const clientConnection &connection)
 {
-    int bytesRead = 0;
-    int totalBytes = 0;
-    memset(buffer, '\0', WA_MAX_INPUT); //Clears the buffer
+    if (!connection.isCompact)
+    {
+        return connection.received.size() >= WA_MAX_INPUT;
+    }
+    size_t frameSize = compact_frame_size(connection.received);
+    return frameSize > 0 && connection.received.size() >= frameSize;
+}
 
-    // read from the socket into the buffer: similarly to whats been in the tirgul
-    while (totalBytes < WA_MAX_INPUT)
+/**
+ * Moves the first whole frame of the client into buffer, decompressing a compact frame.
+ * @param connection the buffers of the client, closed if the frame is malformed
+ * @return true if buffer holds the frame, false o.w
+ */
+bool whatsappServer::takeFrame(clientConnection &connection)
+{
+    memset(buffer, '\0', WA_MAX_INPUT);
+    if (!connection.isCompact)
     {
-        bytesRead = static_cast<int>(read(clientFd, (buffer + totalBytes),
-                                          static_cast<size_t>(WA_MAX_INPUT - totalBytes)));
-        if (bytesRead < 1)
+        memcpy(buffer, connection.received.data(), WA_MAX_INPUT);
+        connection.received.erase(0, WA_MAX_INPUT);
+    }
+    else
+    {
+        std::string payload;
+        if (take_frame(connection.received, payload) < 1)
         {
-            print_error("read()", errno);
-            exit(1);
+            connection.isClosed = true;
+            return false;
         }
-        totalBytes += bytesRead;
+        memcpy(buffer, payload.data(), payload.size());
     }
+    buffer[WA_MAX_INPUT - 1] = '\0';
+    return true;
 }
 
-void whatsappServer::writeToClient(int clientFD, std::string messageToClient)
+/**
+ * Writes as much of the frames a client did not take yet as it takes now.
+ * @param clientFd the socket of the client
+ * @param connection its buffers, closed if writing failed
+ */
+void whatsappServer::flushToClient(int clientFd, clientConnection &connection)
 {
-    memset(buffer, '\0', WA_MAX_INPUT);
-    for (unsigned long i = 0; (i < messageToClient.size() && i < WA_MAX_INPUT); i++)
+    ssize_t bytesWritten = write(clientFd, connection.outgoing.data(), connection.outgoing.size());
+    if (bytesWritten < 0)
     {
-        buffer[i] = messageToClient.at(i);
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            connection.isClosed = true;
+        }
+        return;
     }
-    if (write(clientFD, buffer, WA_MAX_INPUT) < 0)
+    connection.outgoing.erase(0, static_cast<size_t>(bytesWritten));
+}
+
+/**
+ * Closes the sockets of the clients that disconnected or failed. A client that disconnected
+ * without exit is unregistered as if it had sent it.
+ */
+void whatsappServer::dropClosedClients()
+{
+    for (auto connection = connections.begin(); connection != connections.end();)
     {
-        print_error("writeToClient", errno);
-        exit(1);
+        if (!connection->second.isClosed)
+        {
+            ++connection;
+            continue;
+        }
+        const std::string &clientName = connection->second.name;
+        auto clientSocket = clientSockets.find(clientName);
+        if (!clientName.empty() && clientSocket != clientSockets.end() &&
+            clientSocket->second == connection->first)
+        {
+            unregisterClient(clientName);
+            print_exit(true, clientName);
+        }
+        close(connection->first);
+        connection = connections.erase(connection);
+    }
+}
+
+/**
+ * Writes the message to the client as a single frame, compressed if the client takes
+ * compact frames.
+ * @param clientFD the socket of the client
+ * @param messageToClient the message, cut at WA_MAX_INPUT bytes
+ */
+void whatsappServer::writeToClient(int clientFD, const std::string &messageToClient)
+{
+    auto connection = connections.find(clientFD);
+    bool isCompact = connection != connections.end() && connection->second.isCompact;
+    writeToClient(clientFD, messageToClient,
+                  isCompact ? compress_payload(messageToClient) : std::string());
+}
+
+/**
+ * Writes the message to the client as a single frame: zero padded to WA_MAX_INPUT bytes, or
+ * for a client that takes compact frames a header and the message, or the compressed message
+ * if there is one. A message sent to many clients is compressed once by the caller.
+ * @param clientFD the socket of the client
+ * @param messageToClient the message, cut at WA_MAX_INPUT bytes
+ * @param compressedMessage the message compressed by compress_payload, empty if it is not
+ */
+void whatsappServer::writeToClient(int clientFD, const std::string &messageToClient,
+                                   const std::string &compressedMessage)
+{
+    //The payload is written straight from the string and padded up to a full frame from a
+    //shared block of zeros, so it is never copied into buffer first
+    static const char zeroPadding[WA_MAX_INPUT] = {0};
+    size_t payloadSize = std::min(messageToClient.size(), static_cast<size_t>(WA_MAX_INPUT));
+    iovec frame[2];
+    frame[0].iov_base = const_cast<char *>(messageToClient.data());
+    frame[0].iov_len = payloadSize;
+    frame[1].iov_base = const_cast<char *>(zeroPadding);
+    frame[1].iov_len = WA_MAX_INPUT - payloadSize;
+    auto connection = connections.find(clientFD);
+    if (connection == connections.end()) //not a client socket, a replay or a benchmark
+    {
+        if (writev(clientFD, frame, 2) < 0)
+        {
+            print_error("writeToClient", errno);
+            exitServer(1);
+        }
+        return;
+    }
+    clientConnection &client = connection->second;
+    if (client.isClosed)
+    {
+        return;
+    }
+    std::string header;
+    if (client.isCompact) //a header and the message instead of the message and the padding
+    {
+        bool isCompressed = !compressedMessage.empty();
+        header = frame_header(isCompressed ? compressedMessage.size() : payloadSize, isCompressed);
+        frame[0].iov_base = const_cast<char *>(header.data());
+        frame[0].iov_len = header.size();
+        frame[1].iov_base = const_cast<char *>(isCompressed ? compressedMessage.data() :
+                                               messageToClient.data());
+        frame[1].iov_len = isCompressed ? compressedMessage.size() : payloadSize;
+    }
+    size_t bytesWritten = 0;
+    if (client.outgoing.empty()) //o.w the frame waits behind the ones queued, to keep the order
+    {
+        ssize_t written = writev(clientFD, frame, 2);
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            client.isClosed = true;
+            return;
+        }
+        bytesWritten = written < 0 ? 0 : static_cast<size_t>(written);
+    }
+    //The client did not take the whole frame, the rest waits until it takes more
+    for (const iovec &part : frame)
+    {
+        if (bytesWritten < part.iov_len)
+        {
+            client.outgoing.append(static_cast<const char *>(part.iov_base) + bytesWritten,
+                                   part.iov_len - bytesWritten);
+        }
+        bytesWritten -= std::min(bytesWritten, part.iov_len);
+    }
+    if (client.outgoing.size() > static_cast<size_t>(MAX_QUEUED_FRAMES) * WA_MAX_INPUT)
+    {
+        client.isClosed = true; //stopped reading, it would hold on to ever more memory
     }
 }
 
 void whatsappServer::newIncomingClient()
 {
+    WA_TRACE_SCOPE("newIncomingClient");
     int newClient = accept(mainSocket, (struct sockaddr *) &serverAddress,
                            (socklen_t *) &addressLength);
     if (newClient < 0)
     {
         print_error("accept", errno);
-        exit(1);
+        exitServer(1);
+    }
+    //The client name is its first frame, read with its other frames once it arrives
+    if (fcntl(newClient, F_SETFL, fcntl(newClient, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        print_error("fcntl", errno);
+        exitServer(1);
     }
-    //Gets the client name.
-    readFromClient(newClient);
+    connections[newClient] = clientConnection();
+}
+
+/**
+ * Registers the client whose name is in buffer under the given socket and informs it.
+ * @param newClient the socket of the client
+ * @return true if the client was registered, false if its name is already in use
+ */
+bool whatsappServer::registerClient(int newClient)
+{
+    auto connection = connections.find(newClient);
     bool existingUser = static_cast<bool>(clientSockets.count(std::string(buffer)));
-    if (existingUser)
+    if (existingUser || !is_valid_name(std::string(buffer)) ||
+        (federation && !federation->claim(std::string(buffer), false))) //taken in the cluster
     {
         //THERE IS ALREADY USER IN THIS NAME CONNECTED AND INFORM THE CLIENT
         feedback = "Failed";
         writeToClient(newClient,feedback);
+        if (connection != connections.end())
+        {
+            connection->second.isLeaving = true;
+        }
+        return false;
     }
-    else
+    clientSockets[std::string(buffer)] = newClient;
+    clientNames.insert(std::make_shared<const std::string>(buffer));
+    presenceChanges.push_back("+" + std::string(buffer));
+    if (federation) //subscribers of the other servers are pushed the join too
+    {
+        postToPeers(std::string(JOINED_MESSAGE " ") + buffer);
+    }
+    feedback = "Succeed";
+    print_connection_server(std::string(buffer));
+    if (connection == connections.end())
     {
-        clientSockets[std::string(buffer)] = newClient;
-        feedback = "Succeed";
-        FD_SET(newClient, &readFDSet);
-        print_connection_server(std::string(buffer));
         writeToClient(newClient,feedback);
+        return true;
+    }
+    connection->second.name = std::string(buffer);
+    //A client offering compact frames is sent them from now on, and told so after the
+    //feedback where a client that does not know them only sees padding
+    bool isCompact = offers_compact_mode(buffer);
+    writeToClient(newClient, isCompact ? feedback + '\0' + COMPACT_MODE : feedback);
+    connection->second.isCompact = isCompact;
+    return true;
+}
+
+/**
+ * Unregisters the client and removes it from all groups, whether it sent exit or
+ * disconnected.
+ * @param clientName the client
+ */
+void whatsappServer::unregisterClient(const std::string &clientName)
+{
+    clientSockets.erase(clientName); //removes from client list
+    clientNames.erase(clientNames.find(clientName));
+    clientRates.erase(clientName);
+    removeFromGroups(clientName);
+    if (federation) //frees the name and leaves the groups of the other servers too
+    {
+        federation->release(clientName);
+        postToPeers(std::string(LEFT_MESSAGE " ") + clientName);
+    }
+    presenceSubscribers.erase(clientName);
+    presenceChanges.push_back("-" + clientName);
+}
+
+void whatsappServer::startRecording(const char *logPath)
+{
+    recorder.reset(new whatsappRecorder(logPath));
+}
+
+/**
+ * Makes the server one of a cluster, whose clients and groups can reach each other.
+ * @param peerPorts the peer ports of the cluster separated by comma, this server's first
+ */
+void whatsappServer::federate(const char *peerPorts)
+{
+    federation.reset(new whatsappFederation(
+            peerPorts,
+            [this](const std::string &request, std::string &reply)
+            { return handlePeerRequest(request, reply); },
+            [this](int status) { exitServer(status); }));
+}
+
+/**
+ * Answers a request of another server of the cluster. Only uses its arguments and never
+ * sends a request, since it may run while this server waits on a request of its own.
+ * @param request the request line
+ * @param reply set to the reply line
+ * @return false if the request has no reply, true o.w
+ */
+bool whatsappServer::handlePeerRequest(const std::string &request, std::string &reply)
+{
+    size_t position = 0;
+    size_t tokenStart;
+    std::vector<std::string> arguments;
+    size_t length;
+    //The message of DELIVER, the last argument, may hold spaces
+    while (arguments.size() < 5 && (length = next_token(request, position, tokenStart)) != 0)
+    {
+        arguments.emplace_back(request, tokenStart, length);
+        if (arguments.front() == DELIVER_MESSAGE && arguments.size() == 2)
+        {
+            arguments.emplace_back(request, std::min(position + 1, request.size()));
+            break;
+        }
+    }
+    if (arguments.size() == 3 && arguments[0] == CLIENTS_REQUEST)
+    {
+        std::string prefix = arguments[1] == NO_ARGUMENT ? "" : arguments[1];
+        reply.clear();
+        for (auto client = firstConnectedClient(prefix, arguments[2] == NO_ARGUMENT ? "" : arguments[2]);
+             client != clientSockets.end() && client->first.compare(0, prefix.size(), prefix) == 0;
+             ++client)
+        {
+            reply.append(client->first).append(",");
+        }
+        if (!reply.empty())
+        {
+            reply.pop_back();
+        }
+        return true;
+    }
+    if (arguments.size() == 2 && arguments[0] == MEMBERS_REQUEST)
+    {
+        auto group = groups.find(arguments[1]);
+        if (group == groups.end())
+        {
+            reply = "nogroup";
+            return true;
+        }
+        reply = "group ";
+        for (const memberName &member : *group->second)
+        {
+            reply.append(*member).append(",");
+        }
+        reply.pop_back();
+        return true;
+    }
+    if (arguments.size() == 5 && arguments[0] == UPDATE_REQUEST)
+    {
+        std::vector<std::string> sortedNames;
+        split_names(arguments[4], sortedNames);
+        reply = applyGroupUpdate(arguments[1], arguments[2], arguments[3] == "+", sortedNames) ?
+                "OK" : "FAIL";
+        return true;
+    }
+    if (arguments.size() == 3 && arguments[0] == DELIVER_MESSAGE)
+    {
+        std::vector<std::string> recipients;
+        split_names(arguments[1], recipients);
+        std::string compressedMessage = compress_payload(arguments[2]);
+        for (const std::string &recipient : recipients)
+        {
+            auto recipientSocket = clientSockets.find(recipient);
+            if (recipientSocket != clientSockets.end())
+            {
+                writeToClient(recipientSocket->second, arguments[2], compressedMessage);
+            }
+        }
+        return false;
+    }
+    if (arguments.size() == 2 && arguments[0] == JOINED_MESSAGE)
+    {
+        presenceChanges.push_back("+" + arguments[1]);
+    }
+    if (arguments.size() == 2 && arguments[0] == LEFT_MESSAGE)
+    {
+        removeFromGroups(arguments[1]);
+        presenceChanges.push_back("-" + arguments[1]);
+    }
+    return false;
+}
+
+/**
+ * Posts a message that has no reply to every other server of the cluster, one that cannot
+ * be reached misses it.
+ * @param message the message
+ */
+void whatsappServer::postToPeers(const std::string &message)
+{
+    for (int peer : federation->cluster())
+    {
+        if (peer != federation->self())
+        {
+            federation->post(peer, message);
+        }
+    }
+}
+
+/**
+ * Feeds a recorded log through the command handling of the server, without any socket.
+ * Replies are written to /dev/null, the server output is printed as usual. The rate limiter
+ * only decides when a socket is read, so the frames are handled in recorded order whatever
+ * the speedup and a replay does not depend on the clock.
+ * @param logPath a log written with --record
+ * @param speedup how many times faster than recorded to replay, 0 replays without waiting
+ */
+void whatsappServer::replay(const char *logPath, double speedup)
+{
+    FILE *log = whatsappRecorder::openLog(logPath);
+    int nullFD = open("/dev/null", O_WRONLY);
+    if (log == nullptr || nullFD < 0)
+    {
+        print_server_usage();
+        exit(1);
+    }
+    std::map<uint32_t, std::string> connectionNames; //key: recorded connection , value: name
+    frameRecord record;
+    uint64_t firstTimestamp = 0;
+    unsigned long replayedFrames = 0;
+    auto replayStart = std::chrono::steady_clock::now();
+    while (whatsappRecorder::readRecord(log, record))
+    {
+        if (replayedFrames == 0)
+        {
+            firstTimestamp = record.timestampMicros;
+        }
+        if (speedup > 0)
+        {
+            std::this_thread::sleep_until(replayStart + std::chrono::microseconds(
+                    static_cast<long long>((record.timestampMicros - firstTimestamp) / speedup)));
+        }
+        if (record.kind == RECORD_CONNECT)
+        {
+            if (handleFrame(nullFD, "", record.payload))
+            {
+                connectionNames[record.connectionId] = record.payload.c_str();
+            }
+        }
+        else
+        {
+            auto connection = connectionNames.find(record.connectionId);
+            if (connection != connectionNames.end() && clientSockets.count(connection->second))
+            {
+                handleFrame(nullFD, connection->second, record.payload);
+            }
+        }
+        publishPresence();
+        replayedFrames++;
+    }
+    auto replayTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - replayStart);
+    printf("Replayed %lu frames in %lld ms.\n", replayedFrames,
+           static_cast<long long>(replayTime.count()));
+    fclose(log);
+    close(nullFD);
+}
+
+/**
+ * Finds the first connected client name to list.
+ * @param prefix only names starting with it are listed
+ * @param cursor only names after it are listed, empty starts from the first name
+ * @return the first client to list, the names sharing the prefix follow it
+ */
+std::map<std::string, int>::const_iterator whatsappServer::firstConnectedClient(
+        const std::string &prefix, const std::string &cursor)
+{
+    if (!cursor.empty() && cursor >= prefix)
+    {
+        return clientSockets.upper_bound(cursor);
+    }
+    return clientSockets.lower_bound(prefix);
+}
+
+/**
+ * Asks the other servers of the cluster for the names of their clients.
+ * @param prefix only names starting with it are listed
+ * @param cursor only names after it are listed, empty starts from the first name
+ * @return the names, sorted
+ */
+std::vector<std::string> whatsappServer::peerClients(const std::string &prefix,
+                                                     const std::string &cursor)
+{
+    std::vector<std::string> names;
+    for (int peer : federation->cluster())
+    {
+        if (peer != federation->self())
+        {
+            split_names(federation->request(peer, std::string(CLIENTS_REQUEST " ") +
+                                                  (prefix.empty() ? NO_ARGUMENT : prefix) + " " +
+                                                  (cursor.empty() ? NO_ARGUMENT : cursor)), names);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/**
+ * Handles a frame as if it was read from a client socket, for a replay or a benchmark.
+ * @param fd the socket the replies are written to
+ * @param clientName the client that sent the frame, empty for the name of a new client
+ * @param frame the received bytes, cut at WA_MAX_INPUT bytes
+ * @return false if the frame is a name that was not registered, true o.w
+ */
+bool whatsappServer::handleFrame(int fd, const std::string &clientName, const std::string &frame)
+{
+    memset(buffer, '\0', WA_MAX_INPUT);
+    memcpy(buffer, frame.data(), std::min(frame.size(), static_cast<size_t>(WA_MAX_INPUT)));
+    if (clientName.empty())
+    {
+        return registerClient(fd);
+    }
+    clientFD = fd;
+    handleClientCommand(clientName);
+    return true;
+}
+
+/**
+ * Streams the connected client names to the client, in frames. clientSockets is ordered by
+ * name, so the names are written straight from it without sorting a copy, and every frame
+ * but the last ends with a comma to tell the client more names follow. In a cluster the
+ * names of the other servers are merged in.
+ * @param clientFD the socket of the client
+ * @param prefix only names starting with it are written
+ * @param cursor only names after it are written, empty starts from the first name
+ */
+void whatsappServer::writeConnectedClients(int clientFD, const std::string &prefix,
+                                           const std::string &cursor)
+{
+    std::vector<std::string> peerNames;
+    if (federation)
+    {
+        peerNames = peerClients(prefix, cursor);
+    }
+    std::string frame;
+    frame.reserve(WA_MAX_INPUT);
+    auto appendName = [&](const std::string &clientName)
+    {
+        if (!frame.empty() && frame.size() + clientName.size() + 1 >= WA_MAX_INPUT)
+        {
+            writeToClient(clientFD, frame);
+            frame.clear();
+        }
+        frame.append(clientName).append(",");
+    };
+    auto peerName = peerNames.begin();
+    //Names sharing the prefix are adjacent, so the walk stops at the first one without it
+    for (auto client = firstConnectedClient(prefix, cursor);
+         client != clientSockets.end() && client->first.compare(0, prefix.size(), prefix) == 0;
+         ++client)
+    {
+        for (; peerName != peerNames.end() && *peerName < client->first; ++peerName)
+        {
+            appendName(*peerName);
+        }
+        appendName(client->first);
+    }
+    for (; peerName != peerNames.end(); ++peerName)
+    {
+        appendName(*peerName);
+    }
+    if (!frame.empty())
+    {
+        frame.pop_back();
+    }
+    writeToClient(clientFD, frame);
+}
+
+
+/**
+ * Decides whether a name is already owned by a client or a group, clients and groups share
+ * one namespace.
+ * @param name the name to look up
+ * @return true if a connected client or an existing group has this name, false o.w
+ */
+bool whatsappServer::isNameTaken(const std::string &name)
+{
+    return clientSockets.count(name) > 0 || groups.count(name) > 0;
+}
+
+/**
+ * Removes the client from every group it is a member of by publishing a new snapshot of
+ * each such group, snapshots already handed out stay untouched. A group left without
+ * members is deleted, so it no longer holds its name or counts towards WA_MAX_GROUP.
+ * @param clientName the client to remove
+ */
+void whatsappServer::removeFromGroups(const std::string &clientName)
+{
+    for (auto group = groups.begin(); group != groups.end();)
+    {
+        const std::vector<memberName> &current = *group->second;
+        auto member = std::lower_bound(current.begin(), current.end(), clientName,
+                                       memberNameLess());
+        if (member == current.end() || **member != clientName)
+        {
+            ++group;
+        }
+        else if (current.size() == 1)
+        {
+            if (federation)
+            {
+                federation->release(group->first);
+            }
+            group = groups.erase(group);
+        }
+        else
+        {
+            std::vector<memberName> updated;
+            updated.reserve(current.size() - 1);
+            updated.insert(updated.end(), current.begin(), member);
+            updated.insert(updated.end(), member + 1, current.end());
+            group->second = std::make_shared<const std::vector<memberName>>(std::move(updated));
+            ++group;
+        }
     }
 }
 
-std::string whatsappServer::connectedClients(std::map <std::string, int> clientSockets)
+/**
+ * Checks that every name in a sorted list belongs to a connected client. Long lists are
+ * checked in a single merge pass over the name-ordered clientSockets, short ones with a
+ * lookup per name.
+ * @param sortedNames names sorted without duplicates
+ * @return true if all of the names are connected clients, false o.w
+ */
+bool whatsappServer::allConnected(const std::vector<std::string> &sortedNames)
 {
-    std::vector<std::string> clientNames;
-    for (const auto &client : clientSockets)
+    if (federation) //the names not connected here are looked up at once in the cluster
     {
-        clientNames.push_back(client.first);
+        std::vector<std::string> peerNames;
+        for (const auto &clientName : sortedNames)
+        {
+            if (!clientSockets.count(clientName))
+            {
+                peerNames.push_back(clientName);
+            }
+        }
+        std::vector<int> owners = federation->locate(peerNames);
+        return std::all_of(owners.begin(), owners.end(), [](int owner) { return owner > 0; });
     }
-    std::sort(clientNames.begin(), clientNames.end(), std::less<std::string>());
-    std::string connectedClientNames; //Will hold the names to display
-    connectedClientNames = "";
-    for (const std::string &clientName : clientNames)
-        connectedClientNames += clientName + ",";
-    connectedClientNames.pop_back(); //message to display
-    return connectedClientNames;
+    if (sortedNames.size() * BULK_LOOKUP_RATIO < clientSockets.size())
+    {
+        for (const auto &clientName : sortedNames)
+        {
+            if (!clientSockets.count(clientName))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    auto client = clientSockets.begin();
+    for (const auto &clientName : sortedNames)
+    {
+        while (client != clientSockets.end() && client->first < clientName)
+        {
+            ++client;
+        }
+        if (client == clientSockets.end() || client->first != clientName)
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
+/**
+ * Looks up the interned names of connected clients, clients of other servers of a cluster
+ * get a name of their own.
+ * @param sortedNames names of connected clients, sorted without duplicates
+ * @return the interned names in the same order
+ */
+std::vector<memberName> whatsappServer::internNames(const std::vector<std::string> &sortedNames)
+{
+    std::vector<memberName> interned;
+    interned.reserve(sortedNames.size());
+    for (const auto &clientName : sortedNames)
+    {
+        auto localName = clientNames.find(clientName);
+        interned.push_back(localName != clientNames.end() ? *localName :
+                           std::make_shared<const std::string>(clientName));
+    }
+    return interned;
+}
+
+/**
+ * Handles add_to_group and remove_from_group: the sender must be a member of the group and
+ * added clients must be connected. In a cluster a group kept by another server is updated
+ * there.
+ * @param tempClientName the client that sent the command
+ * @param isAdd true to add the listed clients, false to remove them
+ */
+void whatsappServer::updateGroup(const std::string &tempClientName, bool isAdd)
+{
+    std::sort(clients.begin(), clients.end());
+    clients.erase(unique(clients.begin(), clients.end()), clients.end());
+    bool isUpdated = false;
+    if (!clients.empty() && (!isAdd || allConnected(clients)))
+    {
+        int owner = 0;
+        if (federation && !groups.count(name))
+        {
+            owner = federation->locate(std::vector<std::string>{name}).front();
+        }
+        if (owner < 0) //kept by another server
+        {
+            std::string names;
+            for (const auto &clientName : clients)
+            {
+                names.append(clientName).append(",");
+            }
+            names.pop_back();
+            isUpdated = federation->request(-owner, std::string(UPDATE_REQUEST " ") + name + " " +
+                                                    tempClientName + (isAdd ? " + " : " - ") +
+                                                    names) == "OK";
+        }
+        else
+        {
+            isUpdated = applyGroupUpdate(name, tempClientName, isAdd, clients);
+        }
+    }
+    if (isUpdated)
+    {
+        feedback = "Succeed";
+        printf("%s: Group \"%s\" was updated successfully.\n", tempClientName.c_str(),
+               name.c_str());
+    }
+    else
+    {
+        printf("%s: ERROR: failed to update group \"%s\".\n", tempClientName.c_str(),
+               name.c_str());
+    }
+    writeToClient(clientFD,feedback);
+}
+
+/**
+ * Updates a group this server keeps. The change is merged into a new snapshot of the group
+ * in one pass, instead of rebuilding and sorting the member list, and the snapshot shares the
+ * interned names rather than copying them. A group whose last members are removed is deleted.
+ * @param groupName the group
+ * @param sender the client that sent the command, must be a member of the group
+ * @param isAdd true to add the names, false to remove them
+ * @param sortedNames the names, sorted without duplicates, connected if they are added and
+ * members if they are removed
+ * @return true if the group was updated, false o.w
+ */
+bool whatsappServer::applyGroupUpdate(const std::string &groupName, const std::string &sender,
+                                      bool isAdd, const std::vector<std::string> &sortedNames)
+{
+    auto group = groups.find(groupName);
+    if (group == groups.end() || sortedNames.empty() ||
+        !std::binary_search(group->second->begin(), group->second->end(), sender,
+                            memberNameLess()))
+    {
+        return false;
+    }
+    const std::vector<memberName> &current = *group->second;
+    std::vector<memberName> updated;
+    updated.reserve(current.size() + (isAdd ? sortedNames.size() : 0));
+    if (isAdd)
+    {
+        std::vector<memberName> added = internNames(sortedNames);
+        std::set_union(current.begin(), current.end(), added.begin(), added.end(),
+                       std::back_inserter(updated), memberNameLess());
+    }
+    else
+    {
+        std::set_difference(current.begin(), current.end(), sortedNames.begin(),
+                            sortedNames.end(), std::back_inserter(updated), memberNameLess());
+        //Every name removed a member only if the group shrank by all of them, which is
+        //std::includes(current, sortedNames) without another pass
+        if (updated.size() + sortedNames.size() != current.size())
+        {
+            return false;
+        }
+    }
+    if (updated.empty())
+    {
+        if (federation)
+        {
+            federation->release(groupName);
+        }
+        groups.erase(group);
+    }
+    else
+    {
+        group->second = std::make_shared<const std::vector<memberName>>(std::move(updated));
+    }
+    return true;
+}
+
+/**
+ * Asks the server keeping a group for its members.
+ * @param peer the node of the server
+ * @param groupName the group
+ * @return the members, nullptr if there is no such group anymore
+ */
+groupSnapshot whatsappServer::peerGroup(int peer, const std::string &groupName)
+{
+    std::string reply = federation->request(peer, std::string(MEMBERS_REQUEST " ") + groupName);
+    if (reply.compare(0, 6, "group ") != 0)
+    {
+        return nullptr;
+    }
+    std::vector<std::string> memberNames;
+    split_names(reply.substr(6), memberNames);
+    return std::make_shared<const std::vector<memberName>>(internNames(memberNames));
+}
+
+/**
+ * Sends a message to clients of other servers of the cluster, with one message per server
+ * holding all of its recipients.
+ * @param recipients the clients
+ * @param messageToSend the message
+ */
+void whatsappServer::deliver(const std::vector<std::string> &recipients,
+                             const std::string &messageToSend)
+{
+    std::vector<int> owners = federation->locate(recipients);
+    std::map<int, std::string> byServer; //key: node , value: its recipients separated by comma
+    for (size_t i = 0; i < recipients.size(); i++)
+    {
+        if (owners[i] > 0)
+        {
+            byServer[owners[i]].append(recipients[i]).append(",");
+        }
+    }
+    for (auto &server : byServer)
+    {
+        server.second.pop_back();
+        federation->post(server.first, std::string(DELIVER_MESSAGE " ") + server.second + " " +
+                                       messageToSend);
+    }
+}
+
+/**
+ * Builds the "presence +name,-name" frames of the changes gathered since the last push.
+ * @param firstChange the index in presenceChanges of the first change to include
+ * @return the frames, each at most WA_MAX_INPUT bytes
+ */
+std::vector<std::string> whatsappServer::presenceFrames(size_t firstChange)
+{
+    std::vector<std::string> frames;
+    std::string frame = PRESENCE_PREFIX;
+    for (size_t change = firstChange; change < presenceChanges.size(); change++)
+    {
+        if (frame.size() > sizeof(PRESENCE_PREFIX) - 1 &&
+            frame.size() + presenceChanges[change].size() + 1 >= WA_MAX_INPUT)
+        {
+            frame.pop_back();
+            frames.push_back(frame);
+            frame = PRESENCE_PREFIX;
+        }
+        frame.append(presenceChanges[change]).append(",");
+    }
+    frame.pop_back();
+    frames.push_back(frame);
+    return frames;
+}
+
+/**
+ * Pushes the joins and leaves gathered since the last call to every subscriber, as
+ * "presence +name,-name" frames. Called once per loop, so a burst of changes costs a
+ * frame per subscriber rather than one per change. A client that subscribed during the
+ * loop is only pushed the changes made after it was sent the connected names.
+ */
+void whatsappServer::publishPresence()
+{
+    if (presenceChanges.empty())
+    {
+        return;
+    }
+    std::map<size_t, std::vector<std::string>> frames; //key: first change , value: its frames
+    std::map<size_t, std::vector<std::string>> compressedFrames; //the same, compressed once
+    for (auto &subscriber : presenceSubscribers)
+    {
+        auto subscriberSocket = clientSockets.find(subscriber.first);
+        size_t firstChange = subscriber.second;
+        subscriber.second = 0;
+        if (subscriberSocket == clientSockets.end() || firstChange == presenceChanges.size())
+        {
+            continue;
+        }
+        if (!frames.count(firstChange))
+        {
+            frames[firstChange] = presenceFrames(firstChange);
+            for (const std::string &presenceFrame : frames[firstChange])
+            {
+                compressedFrames[firstChange].push_back(compress_payload(presenceFrame));
+            }
+        }
+        for (size_t frame = 0; frame < frames[firstChange].size(); frame++)
+        {
+            writeToClient(subscriberSocket->second, frames[firstChange][frame],
+                          compressedFrames[firstChange][frame]);
+        }
+    }
+    presenceChanges.clear();
+}
 
-void whatsappServer::removeDuplicateNames(std::string currentClient)
+/**
+ * Sorts the listed names without duplicates and adds the creator of the group in place, so
+ * the list is sorted only once.
+ * @param currentClient the client creating the group
+ */
+void whatsappServer::removeDuplicateNames(const std::string &currentClient)
 {
-    clients.push_back(currentClient);
     std::sort(clients.begin(), clients.end());
     clients.erase(unique(clients.begin(), clients.end()), clients.end());
+    auto creator = std::lower_bound(clients.begin(), clients.end(), currentClient);
+    if (creator == clients.end() || *creator != currentClient)
+    {
+        clients.insert(creator, currentClient);
+    }
 }
 
 
+/**
+ * Reads and writes the ready client sockets, then handles the whole frames read so far.
+ * The clients are served in round robin, a bounded batch of frames each, and every frame
+ * takes a token of its client.
+ */
 void whatsappServer::clientNewInput()
 {
-    std::map<std::string, int> tempClientSockets;
-    tempClientSockets.insert(clientSockets.begin(), clientSockets.end());
-    for (const auto &client :tempClientSockets)
+    for (auto &connection : connections)
     {
-        if (client.second == 0) continue;
-        clientFD = client.second; //current client FD
-        std::string tempClientName = client.first;
-        if (FD_ISSET(clientFD, &readFDSet))
+        if (FD_ISSET(connection.first, &writeFDSet))
+        {
+            flushToClient(connection.first, connection.second);
+        }
+        if (FD_ISSET(connection.first, &readFDSet))
         {
-            //reads the incoming message
-            //0 means eof we assume this is not the case and the input is valid
-            if (read(clientFD, buffer, WA_MAX_INPUT) > 0)
+            receiveFromClient(connection.first, connection.second);
+        }
+    }
+    //Round robin: starts after the client served last, so no client is always served first
+    std::vector<int> readyClients;
+    for (const auto &connection : connections)
+    {
+        if (!connection.second.isClosed && hasWholeFrame(connection.second))
+        {
+            readyClients.push_back(connection.first);
+        }
+    }
+    std::rotate(readyClients.begin(),
+                std::upper_bound(readyClients.begin(), readyClients.end(), lastServedFD),
+                readyClients.end());
+    for (int readyClient : readyClients)
+    {
+        lastServedFD = readyClient;
+        for (int frame = 0; frame < CLIENT_BATCH_FRAMES; frame++)
+        {
+            //Looked up again every frame, since EXIT changes the connection
+            clientConnection &connection = connections[readyClient];
+            const std::string clientName = connection.name;
+            if (connection.isClosed || connection.isLeaving || !hasWholeFrame(connection) ||
+                (!clientName.empty() && availableTokens(clientName) < 1))
+            {
+                break;
+            }
+            WA_TRACE_SCOPE("clientNewInput");
+            if (!takeFrame(connection))
+            {
+                break;
+            }
+            if (recorder)
+            {
+                recorder->record(static_cast<uint32_t>(readyClient),
+                                 clientName.empty() ? RECORD_CONNECT : RECORD_FRAME, buffer,
+                                 strnlen(buffer, WA_MAX_INPUT));
+            }
+            if (clientName.empty()) //the first frame is the client name
+            {
+                registerClient(readyClient);
+                continue;
+            }
+            clientRates[clientName].tokens--;
+            clientFD = readyClient; //current client FD
+            handleClientCommand(clientName);
+        }
+    }
+    dropClosedClients();
+}
+
+/**
+ * Refills the token bucket of a client for the time passed since its last refill.
+ * @param clientName the client
+ * @return the tokens the client has, every frame read from it takes one
+ */
+double whatsappServer::availableTokens(const std::string &clientName)
+{
+    tokenBucket &bucket = clientRates[clientName];
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - bucket.lastRefill;
+    bucket.tokens = std::min(static_cast<double>(CLIENT_BURST),
+                             bucket.tokens + elapsed.count() * CLIENT_RATE_PER_SECOND);
+    bucket.lastRefill = now;
+    return bucket.tokens;
+}
+
+void whatsappServer::handleClientCommand(const std::string &tempClientName)
+{
+    WA_TRACE_SCOPE("handleClientCommand");
+    bool isSubscribe = std::string(buffer) == SUBSCRIBE_COMMAND;
+    bool isGroupUpdate = false;
+    bool isAddCommand;
+    bool isValidWho;
+    std::string whoPrefix;
+    std::string whoCursor;
+    if (!isSubscribe)
+    {
+        WA_TRACE_SCOPE("parse_command");
+        if (parse_who(std::string(buffer), whoPrefix, whoCursor, isValidWho))
+        {
+            commandT = isValidWho ? WHO : INVALID;
+        }
+        else
+        {
+            isGroupUpdate = parse_group_update(std::string(buffer), isAddCommand, name, clients);
+            if (!isGroupUpdate)
             {
                 parse_command(std::string(buffer), commandT, name, message, clients);
-                std::string messageToSend;
-                feedback = "Failed";
-                switch (commandT)
+            }
+        }
+    }
+    std::string messageToSend;
+    std::map<std::string, int>::const_iterator targetClient;
+    std::map<std::string, groupSnapshot>::const_iterator targetGroup;
+    groupSnapshot members; //kept for the whole fan-out even if the group changes meanwhile
+    feedback = "Failed";
+    if (isGroupUpdate)
+    {
+        updateGroup(tempClientName, isAddCommand);
+        return;
+    }
+    if (isSubscribe)
+    {
+        /*
+            Sends the currently connected client names like WHO does, after which the
+            server pushes every join and leave to the client as they happen.
+        */
+        presenceSubscribers[tempClientName] = presenceChanges.size();
+        printf("%s: Subscribes to the connected client names.\n", tempClientName.c_str());
+        writeConnectedClients(clientFD, "", "");
+        return;
+    }
+    switch (commandT)
+    {
+        case CREATE_GROUP:
+            /*
+                    Sends request to create a new group named “group_name” with "
+                    <list_of_client_names>" as group members. “group_name” is unique (i.e. no
+                    other group or client​ with this name is allowed) and includes only
+                    letters and digits. <list_of_client_names> is separated by comma without
+                    any spaces.For example: create_group osStaff david,eshed,eytan,yair"
+            */
+
+            if (groups.size() < WA_MAX_GROUP) //we can add another group
+            {
+                if (!is_valid_name(name) || isNameTaken(name)) //bad name or already in use
                 {
-                    case CREATE_GROUP:
-                        /*
-                                Sends request to create a new group named “group_name” with "
-                                <list_of_client_names>" as group members. “group_name” is unique (i.e. no
-                                other group or client​ with this name is allowed) and includes only
-                                letters and digits. <list_of_client_names> is separated by comma without
-                                any spaces.For example: create_group osStaff david,eshed,eytan,yair"
-                        */
-
-                        if (groups.size() < WA_MAX_GROUP) //we can add another group
-                        {
-                            for (const auto &clientName :clientSockets)
-                            {
-                                if (clientName.first == name) //there is a client with this name
-                                {
-                                    print_create_group(true, false, tempClientName, name);
-                                    writeToClient(clientFD,feedback);
-                                    return;
-                                }
-                            }
-                            for (const auto &tempGroup : groups)
-                            {
-                                if (tempGroup.first == name) //there  is a group with this name
-                                {
-                                    print_create_group(true, false, tempClientName, name);
-                                    writeToClient(clientFD,feedback);
-                                    return;
-                                }
-                            }
-                            removeDuplicateNames(tempClientName);
-                            for (const auto &tempClient : clients)
-                            {
-                                if (!clientSockets.count(tempClient)) //non existing client
-                                {
-                                    print_create_group(true, false, tempClientName, name);
-                                    writeToClient(clientFD,feedback);
-                                    return;                                }
-                            }
-                            //Every thing is legit if we got here Adds clients to groups
-                            //feedback defined above has success
-                            groups[name] = clients;
-                            feedback = "Succeed";
-                            print_create_group(true, true, tempClientName, name);
-                            writeToClient(clientFD,feedback);
-                            return;
-                        }
-                        else
-                        {
-                            print_create_group(true, false, tempClientName, name);
-                            writeToClient(clientFD,feedback);
-                        }
+                    print_create_group(true, false, tempClientName, name);
+                    writeToClient(clientFD,feedback);
+                    return;
+                }
+                removeDuplicateNames(tempClientName);
+                if (!allConnected(clients) || //non existing client
+                    (federation && !federation->claim(name, true))) //in use in the cluster
+                {
+                    print_create_group(true, false, tempClientName, name);
+                    writeToClient(clientFD,feedback);
+                    return;
+                }
+                //Every thing is legit if we got here Adds clients to groups
+                //feedback defined above has success
+                groups[name] = std::make_shared<const std::vector<memberName>>(internNames(clients));
+                feedback = "Succeed";
+                print_create_group(true, true, tempClientName, name);
+                writeToClient(clientFD,feedback);
+                return;
+            }
+            else
+            {
+                print_create_group(true, false, tempClientName, name);
+                writeToClient(clientFD,feedback);
+            }
+            return;
+        case SEND:
+            /*
+                If name is a client name it sends <sender_client_name>: <message> only to the
+                specified client. If name is a group name it sends <sender_client_name>:
+                <message> to all group members (except the sender client).
+            */
+            messageToSend.append(tempClientName).append(": ").append(message);
+            targetClient = clientSockets.find(name);
+            if (targetClient != clientSockets.end()) //the target user exists
+            {
+                feedback = "Succeed";
+                print_send(true, true, tempClientName, name, message);
+                writeToClient(clientFD,feedback);
+                writeToClient(targetClient->second,messageToSend);
+                return;
+            }
+            else //Group Case
+            {
+                targetGroup = groups.find(name);
+                if (targetGroup != groups.end())
+                {
+                    members = targetGroup->second;
+                }
+                else if (federation) //the client or group may be on another server
+                {
+                    int owner = federation->locate(std::vector<std::string>{name}).front();
+                    //A client of another server, fails if that server cannot be reached
+                    if (owner > 0 && federation->post(owner, std::string(DELIVER_MESSAGE " ") +
+                                                             name + " " + messageToSend))
+                    {
+                        feedback = "Succeed";
+                        print_send(true, true, tempClientName, name, message);
+                        writeToClient(clientFD,feedback);
                         return;
-                    case SEND:
-                        /*
-                            If name is a client name it sends <sender_client_name>: <message> only to the
-                            specified client. If name is a group name it sends <sender_client_name>:
-                            <message> to all group members (except the sender client).
-                        */
-                        messageToSend.append(tempClientName).append(": ").append(message);
-                        if (clientSockets.count(name)) //the target user exists
+                    }
+                    if (owner < 0)
+                    {
+                        members = peerGroup(-owner, name);
+                    }
+                }
+                if (members) //Such group exists
+                {
+                    {
+                        WA_TRACE_SCOPE("membershipCheck");
+                        //Looking if indeed sender is part of the group
+                        if (std::binary_search(members->begin(), members->end(), tempClientName,
+                                               memberNameLess()))
                         {
                             feedback = "Succeed";
-                            print_send(true, true, tempClientName, name, message);
-                            writeToClient(clientFD,feedback);
-                            writeToClient(clientSockets[name],messageToSend);
-                            return;
                         }
-                        else //Group Case
+                    }
+                    if (feedback == "Succeed")
+                    {
                         {
-                            if (groups.count(name)) //Such group exists
+                            WA_TRACE_SCOPE("fanOut");
+                            //Every member is sent the same message without copying it, and
+                            //it is compressed once for all the members taking compact frames
+                            std::string compressedMessage = compress_payload(messageToSend);
+                            std::vector<std::string> peerMembers; //clients of other servers
+                            for (const auto &member : *members)
                             {
-                                for (const auto &member : groups[name])
+                                if (*member != tempClientName) //Member other than
+                                    // the sender
                                 {
-                                    if (tempClientName == member) //Looking if indeed
-                                        // sender is part of the group
+                                    targetClient = clientSockets.find(*member);
+                                    if (targetClient != clientSockets.end())
                                     {
-                                        feedback = "Succeed";
-                                        break;
+                                        writeToClient(targetClient->second, messageToSend,
+                                                      compressedMessage);
                                     }
-                                }
-                                if (feedback == "Succeed")
-                                {
-                                    for (const auto &member : groups[name])
+                                    else if (federation)
                                     {
-                                        if (member != tempClientName) //Member other than
-                                            // the sender
-                                        {
-                                            writeToClient(clientSockets[member],messageToSend);
-                                        }
+                                        peerMembers.push_back(*member);
                                     }
-                                    writeToClient(clientFD,feedback); //inform the sender success
-                                    print_send(true, true, tempClientName, name, message);
-                                    return;
-                                }
-                                else //sender is not part of the group
-                                {
-                                    print_send(true, false, tempClientName, name, message);
-                                    writeToClient(clientFD,feedback);
-                                    return;
                                 }
                             }
-                            else //No group or client with this name
+                            if (!peerMembers.empty())
                             {
-                                print_send(true, false, tempClientName, name, message);
-                                writeToClient(clientFD,feedback);
-                                return;
+                                deliver(peerMembers, messageToSend);
                             }
+                            writeToClient(clientFD,feedback); //inform the sender success
                         }
-                    case WHO:
-                        /*
-                            Sends a request (to the server) to receive a list (might be empty) of
-                            currently connected client names (alphabetically order), separated by comma
-                            without spaces.
-                        */
-                        print_who_server(tempClientName);
-                        feedback = connectedClients(clientSockets);
-                        writeToClient(clientFD,feedback);
+                        WA_TRACE_SCOPE("print_send");
+                        print_send(true, true, tempClientName, name, message);
                         return;
-                    case EXIT:
-                        /*
-                            Unregisters the client from the server and removes it from all
-                            groups. After the server unregistered the client, the client
-                            should print “Unregistered successfully” and then exit(0).
-                        */
-                        clientSockets.erase(tempClientName); //removes from client list
-                        for(auto &group : groups)
-                        {
-                            for(unsigned  int index = 0;index <group.second.size(); index++)
-                            {
-                                if(group.second.at(index) == tempClientName)
-                                {
-                                    group.second.erase(group.second.begin() + index);
-                                    break;
-                                }
-                            }
-                        }
-                        feedback = "Succeed";
-                        print_exit(true, tempClientName);
+                    }
+                    else //sender is not part of the group
+                    {
+                        print_send(true, false, tempClientName, name, message);
                         writeToClient(clientFD,feedback);
                         return;
-                    case INVALID:
-                        return;
+                    }
+                }
+                else //No group or client with this name
+                {
+                    print_send(true, false, tempClientName, name, message);
+                    writeToClient(clientFD,feedback);
+                    return;
                 }
             }
-            else
+        case WHO:
+            /*
+                Sends a request (to the server) to receive a list (might be empty) of
+                currently connected client names (alphabetically order), separated by comma
+                without spaces.
+            */
+            print_who_server(tempClientName);
+            writeConnectedClients(clientFD, whoPrefix, whoCursor);
+            return;
+        case EXIT:
+            /*
+                Unregisters the client from the server and removes it from all
+                groups. After the server unregistered the client, the client
+                should print “Unregistered successfully” and then exit(0).
+            */
+            unregisterClient(tempClientName);
+            feedback = "Succeed";
+            print_exit(true, tempClientName);
+            writeToClient(clientFD,feedback);
+            if (connections.count(clientFD)) //commands it pipelined after exit are dropped
             {
-                print_error("read", errno);
-                exit(1);
+                connections[clientFD].isLeaving = true;
+                connections[clientFD].received.clear();
             }
-        }
+            return;
+        case INVALID:
+            return;
     }
 }
 
 void whatsappServer::run()
 {
+    signal(SIGPIPE, SIG_IGN); //writing to a client that is gone fails instead of killing us
+    timeval noWait = {0, 0};
     while (true)
     {
         setFileDescriptors();
         int maxFD = fdSetClients();
+        if (federation)
+        {
+            maxFD = federation->fdSetPeers(readFDSet, maxFD);
+        }
 
-        //wait for an activity on one of the sockets , timeout is NULL , so wait indefinitely
-        if (select(maxFD +1, &readFDSet, nullptr, nullptr, nullptr) < 0)
+        //wait for an activity on one of the sockets, or until a throttled client may be read
+        //again, o.w the timeout is NULL, so wait indefinitely. Frames already read are
+        //handled without waiting.
+        if (select(maxFD +1, &readFDSet, &writeFDSet, nullptr,
+                   hasBacklog ? &noWait : isThrottled ? &throttleTimeout : nullptr) < 0)
         {
             print_error("select", errno);
-            exit(1);
+            exitServer(1);
+        }
+        //Answers the other servers first: a request sent while serving a client reads the
+        //links too, after which their ready marks are stale
+        if (federation)
+        {
+            federation->servePeers(readFDSet);
         }
         //Reads input from the server
         if (FD_ISSET(STDIN_FILENO, &readFDSet))
@@ -391,10 +1477,12 @@ void whatsappServer::run()
         {
             newIncomingClient();
         }
-        //else its some IO operation from the client side :
-        else
+        //IO operations from the client side are served on the same wakeup
+        clientNewInput();
+        publishPresence();
+        if (federation)
         {
-            clientNewInput();
+            federation->flush();
         }
 
     }
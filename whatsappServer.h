@@ -6,11 +6,81 @@
 #define WHATSAPPSERVER_WHATSAPPSERVER_H
 
 #define MAX_PENDING_CONNECTIONS 10
+#define CLIENT_RATE_PER_SECOND 100 //commands a client may issue per second
+#define CLIENT_BURST 200 //commands a client may issue at once before being limited
+#define CLIENT_BATCH_FRAMES 8 //frames handled from one client per loop before the next is served
+#define MAX_QUEUED_FRAMES 1024 //frames a client may leave unread before it is disconnected
+#define BULK_LOOKUP_RATIO 16 //name lists at least 1/16 of the clients are validated in one pass
+//Requests a federated server answers on its own state, next to the directory requests:
+#define CLIENTS_REQUEST "CLIENTS" //CLIENTS <prefix> <cursor>, replied with its client names
+#define MEMBERS_REQUEST "MEMBERS" //MEMBERS <group>, replied "group <names>" or "nogroup"
+#define UPDATE_REQUEST "UPDATE" //UPDATE <group> <sender> <+ or -> <names>, replied OK or FAIL
+#define DELIVER_MESSAGE "DELIVER" //DELIVER <names> <message>, no reply
+#define JOINED_MESSAGE "JOINED" //JOINED <name>, the client connected, no reply
+#define LEFT_MESSAGE "LEFT" //LEFT <name>, the client left its groups, no reply
+#define NO_ARGUMENT "-" //stands for an empty prefix or cursor
 #include <netinet/in.h>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <set>
 #include "whatsappio.h"
+#include "whatsappCommands.h"
+#include "whatsappRecorder.h"
+#include "whatsappFederation.h"
+#include "whatsappCodec.h"
 
 
+//Per-client token bucket, a default bucket refills to CLIENT_BURST on its first use. A client
+//without a token is not read from until it has one again.
+struct tokenBucket
+{
+    double tokens = 0;
+    std::chrono::steady_clock::time_point lastRefill;
+};
+
+//A client socket. Sockets never block: what was read but does not make up a whole frame yet
+//waits in received, and what the client did not take yet waits in outgoing, so a client
+//that sends half a frame or stops reading never holds up the others.
+struct clientConnection
+{
+    std::string name; //empty until the client registered
+    std::string received;
+    std::string outgoing;
+    bool isCompact = false; //sends and takes compact frames, see whatsappCodec.h
+    bool isLeaving = false; //exited or refused, what it still sends is dropped until it closes
+    bool isClosed = false; //disconnected or failed, dropped at the end of the loop
+};
+
+//A connected client name, interned once when the client registers so group member lists
+//share it instead of copying the string
+typedef std::shared_ptr<const std::string> memberName;
+
+//Orders interned names by the name they hold, and compares them with plain names too
+struct memberNameLess
+{
+    typedef void is_transparent;
+
+    bool operator()(const memberName &first, const memberName &second) const
+    {
+        return *first < *second;
+    }
+
+    bool operator()(const memberName &first, const std::string &second) const
+    {
+        return *first < second;
+    }
+
+    bool operator()(const std::string &first, const memberName &second) const
+    {
+        return first < *second;
+    }
+};
+
+//Immutable member list of a group, sorted by name. Membership changes publish a new
+//snapshot, so a holder of the old one can keep iterating it unchanged.
+typedef std::shared_ptr<const std::vector<memberName>> groupSnapshot;
+
 class whatsappServer
 {
 private:
@@ -24,14 +94,31 @@ private:
     int addressLength = sizeof(serverAddress);
 
     fd_set readFDSet;
+    fd_set writeFDSet; //clients with frames they did not take yet
     sockaddr_in serverAddress;
 
     std::map <std::string, int> clientSockets; // key:client-name , value: fd_num
     //will hold all the users connected
+    std::set<memberName, memberNameLess> clientNames; //the interned names of clientSockets
 
-    std::map<std::string, std::vector<std::string>> groups;
+    std::map<std::string, groupSnapshot> groups;
     //key is group name & value is users/clients in the group
 
+    std::map<int, clientConnection> connections; //key: fd_num , value: its buffers
+    std::map<std::string, tokenBucket> clientRates; //key: client-name , value: its rate limit
+    int lastServedFD = -1; //where the next round robin over ready clients starts
+    bool isThrottled = false; //some client is out of tokens and left out of readFDSet
+    timeval throttleTimeout; //until the earliest throttled client gets a token
+    bool hasBacklog = false; //some client has whole frames left, select must not wait
+
+    std::unique_ptr<whatsappRecorder> recorder; //set when received frames are recorded
+    std::unique_ptr<whatsappFederation> federation; //set when the server is part of a cluster
+
+    //key: client pushed joins and leaves , value: its first change in presenceChanges, the
+    //ones before it are already in the names it was sent when subscribing
+    std::map<std::string, size_t> presenceSubscribers;
+    std::vector<std::string> presenceChanges; //"+name" or "-name" since the last push
+
     //Returns values from the parser
     command_type commandT;
     std::string name;
@@ -41,30 +128,93 @@ private:
 public:
     explicit whatsappServer(char* port);
 
+    whatsappServer();
+
     int validatePort(char *portInput);
 
+    double validateSpeedup(char *speedupInput);
+
+    void startRecording(const char *logPath);
+
+    void federate(const char *peerPorts);
+
+    bool handlePeerRequest(const std::string &request, std::string &reply);
+
+    void postToPeers(const std::string &message);
+
+    void replay(const char *logPath, double speedup);
+
+    bool handleFrame(int fd, const std::string &clientName, const std::string &frame);
+
     void run();
 
-    std::string connectedClients(std::map<std::string, int> clientSockets);
+    std::map<std::string, int>::const_iterator firstConnectedClient(const std::string &prefix,
+                                                                    const std::string &cursor);
 
-    void readFromClient(int clientFd);
+    std::vector<std::string> peerClients(const std::string &prefix, const std::string &cursor);
+
+    void writeConnectedClients(int clientFD, const std::string &prefix, const std::string &cursor);
+
+    void receiveFromClient(int clientFd, clientConnection &connection);
+
+    bool hasWholeFrame(const clientConnection &connection);
+
+    bool takeFrame(clientConnection &connection);
+
+    void flushToClient(int clientFd, clientConnection &connection);
+
+    void dropClosedClients();
 
     void serverInput();
 
+    void exitServer(int status);
+
     void setServerAddress();
 
-    void removeDuplicateNames(std::string currentClient);
+    void removeDuplicateNames(const std::string &currentClient);
+
+    bool isNameTaken(const std::string &name);
+
+    void removeFromGroups(const std::string &clientName);
+
+    bool allConnected(const std::vector<std::string> &sortedNames);
+
+    std::vector<memberName> internNames(const std::vector<std::string> &sortedNames);
+
+    void updateGroup(const std::string &tempClientName, bool isAdd);
+
+    bool applyGroupUpdate(const std::string &groupName, const std::string &sender, bool isAdd,
+                          const std::vector<std::string> &sortedNames);
+
+    groupSnapshot peerGroup(int peer, const std::string &groupName);
+
+    void deliver(const std::vector<std::string> &recipients, const std::string &messageToSend);
+
+    std::vector<std::string> presenceFrames(size_t firstChange);
+
+    void publishPresence();
 
     void setMainSocket();
 
-    void writeToClient(int clientFD, std::string messageToClient);
+    void writeToClient(int clientFD, const std::string &messageToClient);
+
+    void writeToClient(int clientFD, const std::string &messageToClient,
+                       const std::string &compressedMessage);
 
     void setFileDescriptors();
 
     void newIncomingClient();
 
+    bool registerClient(int newClient);
+
+    void unregisterClient(const std::string &clientName);
+
     void clientNewInput();
 
+    void handleClientCommand(const std::string &tempClientName);
+
+    double availableTokens(const std::string &clientName);
+
     int fdSetClients();
 };
 
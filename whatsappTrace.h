@@ -0,0 +1,134 @@
+//
+// Hot-path trace points for the server.
+// Compiled out unless WA_TRACE is defined (e.g. -DWA_TRACE), so the macros cost nothing by
+// default. When enabled every thread records into its own ring buffer and the buffers are
+// exported as Chrome trace JSON (load the file in chrome://tracing or Perfetto).
+//
+
+#ifndef WHATSAPPSERVER_WHATSAPPTRACE_H
+#define WHATSAPPSERVER_WHATSAPPTRACE_H
+
+#ifdef WA_TRACE
+
+#define TRACE_RING_SIZE 65536 //events kept per thread, the oldest are overwritten
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+struct traceEvent
+{
+    const char *stage; //string literal naming the traced stage
+    long long startMicros;
+    long long durationMicros;
+};
+
+class traceRing
+{
+public:
+    int threadId;
+    unsigned long recorded = 0; //total events ever recorded, next slot is recorded % size
+    traceEvent events[TRACE_RING_SIZE];
+
+    explicit traceRing(int id) : threadId(id) {}
+
+    void record(const char *stage, long long startMicros, long long durationMicros)
+    {
+        events[recorded % TRACE_RING_SIZE] = {stage, startMicros, durationMicros};
+        recorded++;
+    }
+};
+
+inline std::mutex &traceRingsMutex()
+{
+    static std::mutex ringsMutex;
+    return ringsMutex;
+}
+
+//Rings are never freed, so a thread's events outlive it until they are exported
+inline std::vector<traceRing *> &traceRings()
+{
+    static std::vector<traceRing *> rings;
+    return rings;
+}
+
+inline traceRing &threadTraceRing()
+{
+    thread_local traceRing *ring = nullptr;
+    if (ring == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(traceRingsMutex());
+        ring = new traceRing(static_cast<int>(traceRings().size()) + 1);
+        traceRings().push_back(ring);
+    }
+    return *ring;
+}
+
+inline long long traceNowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Records the time from its construction to the end of the enclosing scope.
+ */
+class traceScope
+{
+private:
+    const char *stage;
+    long long startMicros;
+public:
+    explicit traceScope(const char *stageName) : stage(stageName), startMicros(traceNowMicros()) {}
+
+    ~traceScope()
+    {
+        threadTraceRing().record(stage, startMicros, traceNowMicros() - startMicros);
+    }
+};
+
+/**
+ * Writes the events of all threads to the given path as Chrome trace JSON.
+ * Meant to be called when the traced threads are idle, e.g. on shutdown.
+ * @param path the file to write
+ */
+inline void traceExport(const char *path)
+{
+    FILE *traceFile = fopen(path, "w");
+    if (traceFile == nullptr)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(traceRingsMutex());
+    bool firstEvent = true;
+    fprintf(traceFile, "{\"traceEvents\":[");
+    for (const traceRing *ring : traceRings())
+    {
+        unsigned long first = ring->recorded > TRACE_RING_SIZE ? ring->recorded - TRACE_RING_SIZE : 0;
+        for (unsigned long i = first; i < ring->recorded; i++)
+        {
+            const traceEvent &event = ring->events[i % TRACE_RING_SIZE];
+            fprintf(traceFile, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                               "\"pid\":1,\"tid\":%d}", firstEvent ? "" : ",", event.stage,
+                    event.startMicros, event.durationMicros, ring->threadId);
+            firstEvent = false;
+        }
+    }
+    fprintf(traceFile, "\n]}\n");
+    fclose(traceFile);
+}
+
+#define WA_TRACE_CONCAT_INNER(a, b) a##b
+#define WA_TRACE_CONCAT(a, b) WA_TRACE_CONCAT_INNER(a, b)
+#define WA_TRACE_SCOPE(stage) traceScope WA_TRACE_CONCAT(traceScope, __LINE__)(stage)
+#define WA_TRACE_EXPORT(path) traceExport(path)
+
+#else
+
+#define WA_TRACE_SCOPE(stage)
+#define WA_TRACE_EXPORT(path)
+
+#endif //WA_TRACE
+
+#endif //WHATSAPPSERVER_WHATSAPPTRACE_H